@@ -0,0 +1,880 @@
+/*
+ * cache.c: In-memory file cache used by the web server.
+ *
+ * Cached files are kept in a chained hash table keyed by file name. Which
+ * file is evicted to make room for a new one is decided by a replacement
+ * policy, see cache_policy.c. Files larger than max_file_size are not cached
+ * at all, so that they can't push out many smaller files.
+ *
+ * The cache is split into shards selected by the hash of the file name. Each
+ * shard has its own lock, hash table, policy state and an equal share of the
+ * cache size, so threads working on unrelated files rarely contend.
+ *
+ * Writers always hold the shard lock. Hash chains are published with atomic
+ * stores, so that with a lockless policy such as CLOCK readers can walk the
+ * chains without taking any lock. Entries unlinked under such a policy are
+ * retired through ebr.c onto a limbo list of the shard, which is reclaimed
+ * with the shard lock held. With the other policies every reader holds the
+ * lock, and unlinked entries are freed right away.
+ *
+ * The cache holds a reference on every file it contains, and a lookup returns
+ * the file with an extra reference for the caller. An evicted file is unpinned
+ * by the cache once no lock-free reader can see it anymore, and is freed when
+ * the last worker sending it unpins it.
+ *
+ * The hash table of a shard starts small and grows or shrinks with the number
+ * of cached files. A resize allocates the new table and then moves a few
+ * buckets of the old table on every locked operation, so no single request
+ * pays for rehashing the whole table. Until all buckets are moved, a file may
+ * be in either table. Lock-free readers can't tell whether they missed a file
+ * because it was moving, so a lock-free miss during a resize is repeated with
+ * the lock held.
+ *
+ * Each shard also tracks the files that are being loaded after a miss, so
+ * that concurrent misses on the same file wait for a single load and share
+ * its result instead of all reading the file from disk.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "ebr.h"
+#include "cache_policy.h"
+#include "pool.h"
+
+/* number of buckets of a new hash table. a table shrinks by half once it has
+ * fewer than an eighth as many files as buckets, but never below this. */
+#define CACHE_MIN_TABLE_SIZE 64
+/* number of old buckets moved to the new table per operation while
+ * resizing. a table grows once it has as many files as buckets, and it is
+ * fully moved long before it has twice as many. */
+#define CACHE_MIGRATE_BUCKETS 4
+/* maximum number of shards, and the smallest size a shard is allowed to have.
+ * a file larger than the shard size is never cached, so small caches use
+ * fewer shards. */
+#define CACHE_NR_SHARDS 16
+#define CACHE_MIN_SHARD_SIZE (1 << 20)
+/* entries for names up to this long are allocated from a pool shared by all
+ * caches, which lasts as long as the process. the others are malloced. */
+#define CACHE_ENTRY_NAME_MAX 63
+
+/* a file name along with its hash and length, which are computed once per
+ * cache operation. entries are compared by hash and length first, so names
+ * only need to be compared for the entry that matches. */
+struct cache_key {
+	char *name;
+	int len;
+	unsigned long hash;
+};
+
+/* a file being loaded by one worker, that other workers are waiting for */
+struct load {
+	struct cache_key key;	/* name is a copy owned by the load */
+	struct file_data *data;	/* pinned result, NULL if the load failed */
+	int done;
+	int nr_waiters;
+	struct load *next;
+};
+
+struct cache_table {
+	struct ebr_node retired;
+	int size;	/* number of buckets, a power of two */
+	_Atomic(struct cache_entry *) buckets[];
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	pthread_cond_t load_done;	/* signalled when any load is done */
+	struct load *loads;		/* loads in progress */
+	_Atomic(struct cache_table *) table;
+	/* while resizing, the files in the buckets of the old table that have
+	 * not been moved yet */
+	_Atomic(struct cache_table *) old_table;
+	int migrated;			/* old buckets moved so far */
+	/* incremented when a resize starts and when it ends, so it is odd
+	 * while resizing */
+	atomic_uint resizes;
+	/* unlinked entries and tables that lock-free readers may still see */
+	struct ebr_limbo limbo;
+	int nr_entries;
+	void *policy;			/* replacement policy state */
+	int maximum_cache_size;
+	int available_cache_size;
+	/* statistics, updated without the lock by lockless lookups */
+	atomic_long hits;
+	atomic_long misses;
+	atomic_long hit_bytes;
+	atomic_long miss_bytes;
+};
+
+struct cache {
+	struct cache_policy *policy;
+	int max_file_size;
+	int nr_shards;
+	struct cache_shard *shards;
+};
+
+/* hash key function */
+/* djb2 hash function found on http://www.cse.yorku.ca/~oz/hash.html#:~:text=If%20you%20just%20want%20to,K%26R%5B1%5D%2C%20etc.
+   Made small adjustment: also returns the length of str */
+static unsigned long
+hash(char *str, int *len)
+{
+	unsigned long hash = 5381;
+	char *p = str;
+	int c;
+
+	while ((c = *p++)){
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	}
+	*len = p - str - 1;
+
+	return hash;
+}
+
+static void
+cache_key_init(struct cache_key *k, char *file_name)
+{
+	k->name = file_name;
+	k->hash = hash(file_name, &k->len);
+}
+
+static struct pool *entry_pool;
+static pthread_once_t entry_pool_once = PTHREAD_ONCE_INIT;
+
+/* the name of a cached file is stored right after its entry */
+static char *
+entry_name(struct cache_entry *e)
+{
+	return (char *)(e + 1);
+}
+
+static void
+entry_pool_init(void)
+{
+	entry_pool = pool_init("cache_entry", sizeof(struct cache_entry) +
+			       CACHE_ENTRY_NAME_MAX + 1);
+}
+
+static struct cache_entry *
+entry_alloc(int name_len)
+{
+	if (name_len > CACHE_ENTRY_NAME_MAX) {
+		return Malloc(sizeof(struct cache_entry) + name_len + 1);
+	}
+	pthread_once(&entry_pool_once, entry_pool_init);
+	return pool_alloc(entry_pool);
+}
+
+static int
+entry_match(struct cache_entry *e, struct cache_key *k)
+{
+	return e->key == k->hash && e->name_len == k->len &&
+		memcmp(entry_name(e), k->name, k->len) == 0;
+}
+
+static int
+key_equal(struct cache_key *a, struct cache_key *b)
+{
+	return a->hash == b->hash && a->len == b->len &&
+		memcmp(a->name, b->name, a->len) == 0;
+}
+
+static struct cache_shard *
+cache_shard(struct cache *cache, struct cache_key *k)
+{
+	return &cache->shards[k->hash % cache->nr_shards];
+}
+
+/* counts a lookup. the size of a missed file is only known once it is loaded,
+ * so it is counted separately with cache_count_bytes. */
+static void
+cache_count(struct cache_shard *s, struct file_data *hit)
+{
+	atomic_fetch_add_explicit(hit ? &s->hits : &s->misses, 1,
+				  memory_order_relaxed);
+	if (hit) {
+		atomic_fetch_add_explicit(&s->hit_bytes, hit->file_size,
+					  memory_order_relaxed);
+	}
+}
+
+static void
+cache_count_bytes(struct cache_shard *s, struct file_data *miss)
+{
+	atomic_fetch_add_explicit(&s->miss_bytes, miss->file_size,
+				  memory_order_relaxed);
+}
+
+static struct cache_table *
+table_alloc(int size)
+{
+	struct cache_table *t;
+	int i;
+
+	t = Malloc(sizeof(struct cache_table) + sizeof(t->buckets[0]) * size);
+	t->size = size;
+	for (i = 0; i < size; i++) {
+		atomic_init(&t->buckets[i], NULL);
+	}
+	return t;
+}
+
+/* key is the hash of a file name, the shard has already consumed its low
+ * bits */
+static _Atomic(struct cache_entry *) *
+table_bucket(struct cache *cache, struct cache_table *t, unsigned long key)
+{
+	return &t->buckets[(key / cache->nr_shards) & (t->size - 1)];
+}
+
+/* returns a pointer to the link that points to the entry for key k, or to
+ * the NULL link at the end of the bucket if the file is not in table t */
+static _Atomic(struct cache_entry *) *
+table_find(struct cache *cache, struct cache_table *t, struct cache_key *k)
+{
+	_Atomic(struct cache_entry *) *link = table_bucket(cache, t, k->hash);
+	struct cache_entry *e;
+
+	while ((e = atomic_load(link)) != NULL && !entry_match(e, k)) {
+		link = &e->hash_next;
+	}
+	return link;
+}
+
+/* returns the entry for key k in table t, or NULL. unlike table_find, this
+ * can be used without the shard lock, since it never reloads a link that a
+ * writer may have changed since the entry was matched. */
+static struct cache_entry *
+table_lookup(struct cache *cache, struct cache_table *t, struct cache_key *k)
+{
+	struct cache_entry *e = atomic_load(table_bucket(cache, t, k->hash));
+
+	while (e != NULL && !entry_match(e, k)) {
+		e = atomic_load(&e->hash_next);
+	}
+	return e;
+}
+
+/* like table_find, but looks at both tables while resizing. must be called
+ * with the shard lock held. a file that is not cached goes to the new table,
+ * so that is where the returned NULL link is. */
+static _Atomic(struct cache_entry *) *
+cache_find(struct cache *cache, struct cache_shard *s, struct cache_key *k)
+{
+	struct cache_table *old = atomic_load(&s->old_table);
+	_Atomic(struct cache_entry *) *link, *old_link;
+
+	link = table_find(cache, atomic_load(&s->table), k);
+	if (atomic_load(link) == NULL && old != NULL) {
+		old_link = table_find(cache, old, k);
+		if (atomic_load(old_link) != NULL) {
+			return old_link;
+		}
+	}
+	return link;
+}
+
+/* moves the next few buckets of the old table while resizing */
+static void
+cache_migrate(struct cache *cache, struct cache_shard *s)
+{
+	struct cache_table *old = atomic_load(&s->old_table);
+	struct cache_table *t = atomic_load(&s->table);
+	int i;
+
+	if (old == NULL) {
+		return;
+	}
+	for (i = 0; i < CACHE_MIGRATE_BUCKETS && s->migrated < old->size;
+	     i++, s->migrated++) {
+		_Atomic(struct cache_entry *) *bucket;
+		struct cache_entry *e;
+
+		bucket = &old->buckets[s->migrated];
+		while ((e = atomic_load(bucket)) != NULL) {
+			_Atomic(struct cache_entry *) *link;
+
+			link = table_bucket(cache, t, e->key);
+			/* a lock-free reader that is walking the old bucket
+			 * may follow e into the new bucket, and miss the rest
+			 * of the old one */
+			atomic_store(bucket, atomic_load(&e->hash_next));
+			atomic_store(&e->hash_next, atomic_load(link));
+			atomic_store(link, e);
+		}
+	}
+	if (s->migrated == old->size) {
+		atomic_store(&s->old_table, NULL);
+		atomic_fetch_add(&s->resizes, 1);
+		if (cache->policy->lockless) {
+			/* lock-free readers may still be looking at the old
+			 * buckets */
+			ebr_retire(&s->limbo, &old->retired, old, free);
+		} else {
+			free(old);
+		}
+	}
+}
+
+/* starts resizing the table if the number of files has outgrown it, or has
+ * become much smaller. a resize in progress is finished first. */
+static void
+cache_resize(struct cache *cache, struct cache_shard *s)
+{
+	struct cache_table *t = atomic_load(&s->table);
+	int size = t->size;
+
+	if (atomic_load(&s->old_table) != NULL) {
+		return;
+	}
+	if (s->nr_entries > size) {
+		size *= 2;
+	} else if (s->nr_entries < size / 8 && size > CACHE_MIN_TABLE_SIZE) {
+		size /= 2;
+	} else {
+		return;
+	}
+	atomic_store(&s->old_table, t);
+	s->migrated = 0;
+	atomic_store(&s->table, table_alloc(size));
+	atomic_fetch_add(&s->resizes, 1);
+}
+
+/* frees an unlinked entry and drops its reference on the file once no reader
+ * can see it */
+static void
+entry_free(void *arg)
+{
+	struct cache_entry *e = arg;
+
+	file_data_put(e->data);
+	if (e->name_len > CACHE_ENTRY_NAME_MAX) {
+		free(e);
+	} else {
+		pool_free(entry_pool, e);
+	}
+}
+
+int
+cache_policy_valid(char *policy)
+{
+	return cache_policy_find(policy) != NULL;
+}
+
+struct cache *
+cache_init(int max_cache_size, struct cache_config *config)
+{
+	struct cache *cache;
+	int i;
+
+	cache = Malloc(sizeof(struct cache));
+	cache->policy = cache_policy_find(config->policy);
+	assert(cache->policy);
+	cache->max_file_size = config->max_file_size;
+	cache->nr_shards = CACHE_NR_SHARDS;
+	while (cache->nr_shards > 1 &&
+	       max_cache_size / cache->nr_shards < CACHE_MIN_SHARD_SIZE) {
+		cache->nr_shards /= 2;
+	}
+	cache->shards = Malloc(sizeof(struct cache_shard) * cache->nr_shards);
+	for (i = 0; i < cache->nr_shards; i++) {
+		struct cache_shard *s = &cache->shards[i];
+
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->load_done, NULL);
+		s->loads = NULL;
+		atomic_init(&s->table, table_alloc(CACHE_MIN_TABLE_SIZE));
+		atomic_init(&s->old_table, NULL);
+		s->migrated = 0;
+		atomic_init(&s->resizes, 0);
+		s->limbo.head = NULL;
+		s->nr_entries = 0;
+		/* the shards together never exceed max_cache_size */
+		s->maximum_cache_size = max_cache_size / cache->nr_shards;
+		s->available_cache_size = s->maximum_cache_size;
+		s->policy = cache->policy->init(s->maximum_cache_size, config);
+		atomic_init(&s->hits, 0);
+		atomic_init(&s->misses, 0);
+		atomic_init(&s->hit_bytes, 0);
+		atomic_init(&s->miss_bytes, 0);
+	}
+	return cache;
+}
+
+/* cache lookup with the shard lock held, a hit is pinned */
+static struct file_data *
+cache_lookup_locked(struct cache *cache, struct cache_shard *s,
+		    struct cache_key *k)
+{
+	struct cache_entry *e;
+
+	cache_migrate(cache, s);
+	e = atomic_load(cache_find(cache, s, k));
+	cache->policy->access(s->policy, k->hash, e);
+	if (e == NULL) {
+		return NULL; /* cache miss */
+	}
+	file_data_get(e->data);
+	return e->data;
+}
+
+/* cache lookup without the shard lock, for lockless policies. returns 0 if
+ * the file was not found while the table was being resized, the lookup must
+ * then be repeated with the lock held. */
+static int
+cache_lookup_lockless(struct cache *cache, struct cache_shard *s,
+		      struct cache_key *k, struct file_data **data)
+{
+	unsigned int resizes;
+	struct cache_table *old;
+	struct cache_entry *e;
+
+	ebr_enter();
+	resizes = atomic_load(&s->resizes);
+	old = atomic_load(&s->old_table);
+	e = table_lookup(cache, atomic_load(&s->table), k);
+	if (e == NULL && old != NULL) {
+		e = table_lookup(cache, old, k);
+	}
+	if (e == NULL) {
+		ebr_exit();
+		*data = NULL; /* cache miss */
+		return !(resizes & 1) && atomic_load(&s->resizes) == resizes;
+	}
+	cache->policy->access(s->policy, k->hash, e);
+	/* the cache's reference can't go away before ebr_exit */
+	file_data_get(e->data);
+	ebr_exit();
+	*data = e->data;
+	return 1;
+}
+
+/* cache lookup, lets the policy know about the access. the returned file is
+ * pinned, the caller must unpin it with file_data_put. */
+struct file_data *
+cache_lookup(struct cache *cache, char *file_name)
+{
+	struct cache_key k;
+	struct cache_shard *s;
+	struct file_data *data;
+
+	cache_key_init(&k, file_name);
+	s = cache_shard(cache, &k);
+	if (!cache->policy->lockless ||
+	    !cache_lookup_lockless(cache, s, &k, &data)) {
+		pthread_mutex_lock(&s->lock);
+		data = cache_lookup_locked(cache, s, &k);
+		pthread_mutex_unlock(&s->lock);
+	}
+	cache_count(s, data);
+	return data;
+}
+
+/* evict files chosen by the policy until required_size bytes are available
+ * in the shard */
+static void
+cache_evict(struct cache *cache, struct cache_shard *s, int required_size)
+{
+	while (s->available_cache_size < required_size) {
+		struct cache_entry *victim = cache->policy->evict(s->policy);
+		_Atomic(struct cache_entry *) *link;
+		struct cache_key k = { entry_name(victim), victim->name_len,
+				       victim->key };
+
+		link = cache_find(cache, s, &k);
+		assert(atomic_load(link) == victim);
+		atomic_store(link, atomic_load(&victim->hash_next));
+		s->available_cache_size += victim->size;
+		s->nr_entries--;
+		if (cache->policy->lockless) {
+			/* lock-free readers may still be looking at the
+			 * entry */
+			ebr_retire(&s->limbo, &victim->retired, victim,
+				   entry_free);
+		} else {
+			entry_free(victim);
+		}
+	}
+}
+
+/* cache insert with the shard lock held */
+static void
+cache_insert_locked(struct cache *cache, struct cache_shard *s,
+		    struct cache_key *k, struct file_data *data)
+{
+	_Atomic(struct cache_entry *) *link;
+	struct cache_entry *e;
+	/* a mapped file is charged for whole pages */
+	int size = file_data_mem_size(data);
+
+	if (size > s->maximum_cache_size ||
+	    (cache->max_file_size && data->file_size > cache->max_file_size)) {
+		return;
+	}
+	cache_migrate(cache, s);
+	link = cache_find(cache, s, k);
+	if (atomic_load(link) != NULL) {
+		return;  /* other thread put the file into cache already */
+	}
+	if (!cache->policy->admit(s->policy, k->hash, size)) {
+		return;
+	}
+	if (size > s->available_cache_size) {
+		cache_evict(cache, s, size);
+		/* eviction may have unlinked the entry that link points into */
+		link = cache_find(cache, s, k);
+	}
+	e = entry_alloc(k->len);
+	memcpy(entry_name(e), k->name, k->len + 1);
+	e->name_len = k->len;
+	file_data_get(data);
+	e->data = data;
+	e->key = k->hash;
+	e->size = size;
+	atomic_init(&e->hash_next, NULL);
+	atomic_init(&e->referenced, 0);
+	cache->policy->insert(s->policy, e);
+	/* publish the fully initialized entry to lock-free readers */
+	atomic_store(link, e);
+	s->available_cache_size -= e->size;
+	s->nr_entries++;
+	cache_resize(cache, s);
+	/* files evicted while a reader was in the way are freed by a later
+	 * insert */
+	ebr_reclaim(&s->limbo);
+}
+
+int
+cache_max_file_size(struct cache *cache)
+{
+	/* all shards have the same size */
+	int max = cache->shards[0].maximum_cache_size;
+
+	if (cache->max_file_size && cache->max_file_size < max) {
+		max = cache->max_file_size;
+	}
+	return max;
+}
+
+/* cache insert */
+void
+cache_insert(struct cache *cache, struct file_data *data)
+{
+	struct cache_key k;
+	struct cache_shard *s;
+
+	cache_key_init(&k, data->file_name);
+	s = cache_shard(cache, &k);
+	pthread_mutex_lock(&s->lock);
+	cache_insert_locked(cache, s, &k, data);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* the load of a file in progress, with the shard lock held */
+static struct load *
+cache_load_find(struct cache_shard *s, struct cache_key *k)
+{
+	struct load *ld;
+
+	for (ld = s->loads; ld != NULL; ld = ld->next) {
+		if (key_equal(&ld->key, k)) {
+			break;
+		}
+	}
+	return ld;
+}
+
+/* starts a load of a file, with the shard lock held */
+static void
+cache_load_start(struct cache_shard *s, struct cache_key *k)
+{
+	struct load *ld = Malloc(sizeof(struct load));
+
+	ld->key = *k;
+	ld->key.name = strdup(k->name);
+	ld->data = NULL;
+	ld->done = 0;
+	ld->nr_waiters = 0;
+	ld->next = s->loads;
+	s->loads = ld;
+}
+
+struct file_data *
+cache_lookup_load(struct cache *cache, char *file_name, int *loader)
+{
+	struct cache_key k;
+	struct cache_shard *s;
+	struct file_data *data;
+	struct load *ld;
+
+	cache_key_init(&k, file_name);
+	s = cache_shard(cache, &k);
+	*loader = 0;
+	if (cache->policy->lockless) {
+		cache_lookup_lockless(cache, s, &k, &data);
+		if (data) {
+			cache_count(s, data);
+			return data;
+		}
+	}
+
+	pthread_mutex_lock(&s->lock);
+	/* with a lockless policy, the file may have been inserted since the
+	 * lookup above */
+	data = cache_lookup_locked(cache, s, &k);
+	cache_count(s, data);
+	if (data) {
+		pthread_mutex_unlock(&s->lock);
+		return data;
+	}
+	ld = cache_load_find(s, &k);
+	if (ld == NULL) {
+		/* we are the first to miss, the caller loads the file */
+		cache_load_start(s, &k);
+		*loader = 1;
+		pthread_mutex_unlock(&s->lock);
+		return NULL;
+	}
+
+	/* wait for the load in progress and share its result */
+	ld->nr_waiters++;
+	while (!ld->done) {
+		pthread_cond_wait(&s->load_done, &s->lock);
+	}
+	data = ld->data;
+	if (data) {
+		file_data_get(data);
+		cache_count_bytes(s, data);
+	}
+	if (--ld->nr_waiters == 0) {
+		/* last waiter frees the finished load */
+		if (ld->data) {
+			file_data_put(ld->data);
+		}
+		free(ld->key.name);
+		free(ld);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return data;
+}
+
+/* finishes a load started by cache_lookup_load or cache_preload_start, count
+ * is set to count the bytes of the loaded file as missed */
+static void
+cache_load_finish(struct cache *cache, char *file_name,
+		  struct file_data *data, int count)
+{
+	struct cache_key k;
+	struct cache_shard *s;
+	struct load **link, *ld;
+
+	cache_key_init(&k, file_name);
+	s = cache_shard(cache, &k);
+	pthread_mutex_lock(&s->lock);
+	for (link = &s->loads; !key_equal(&(*link)->key, &k);
+	     link = &(*link)->next)
+		;
+	ld = *link;
+	*link = ld->next;
+	if (data) {
+		if (count) {
+			cache_count_bytes(s, data);
+		}
+		cache_insert_locked(cache, s, &k, data);
+	}
+	if (ld->nr_waiters == 0) {
+		free(ld->key.name);
+		free(ld);
+	} else {
+		/* the load keeps the result pinned until all waiters have
+		 * taken their own reference */
+		if (data) {
+			file_data_get(data);
+		}
+		ld->data = data;
+		ld->done = 1;
+		pthread_cond_broadcast(&s->load_done);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+cache_load_done(struct cache *cache, char *file_name, struct file_data *data)
+{
+	cache_load_finish(cache, file_name, data, 1);
+}
+
+int
+cache_preload_start(struct cache *cache, char *file_name)
+{
+	struct cache_key k;
+	struct cache_shard *s;
+	int ret = 0;
+
+	cache_key_init(&k, file_name);
+	s = cache_shard(cache, &k);
+	pthread_mutex_lock(&s->lock);
+	cache_migrate(cache, s);
+	/* the policy isn't told, a preload is not an access */
+	if (atomic_load(cache_find(cache, s, &k)) == NULL &&
+	    cache_load_find(s, &k) == NULL) {
+		cache_load_start(s, &k);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return ret;
+}
+
+void
+cache_preload_done(struct cache *cache, char *file_name,
+		   struct file_data *data)
+{
+	cache_load_finish(cache, file_name, data, 0);
+}
+
+/* the files of a shard, pinned, in the order of its policy */
+struct shard_files {
+	struct file_data **files;
+	int nr;
+};
+
+static void
+cache_walk_entry(void *arg, struct cache_entry *e)
+{
+	struct shard_files *sf = arg;
+
+	file_data_get(e->data);
+	sf->files[sf->nr++] = e->data;
+}
+
+void
+cache_walk(struct cache *cache, void (*fn)(void *arg, struct file_data *data),
+	   void *arg)
+{
+	struct shard_files *sf = Malloc(sizeof(struct shard_files) *
+					cache->nr_shards);
+	int i, j, more;
+
+	for (i = 0; i < cache->nr_shards; i++) {
+		struct cache_shard *s = &cache->shards[i];
+
+		pthread_mutex_lock(&s->lock);
+		sf[i].files = Malloc(sizeof(struct file_data *) *
+				     (s->nr_entries + 1));
+		sf[i].nr = 0;
+		cache->policy->walk(s->policy, cache_walk_entry, &sf[i]);
+		assert(sf[i].nr == s->nr_entries);
+		pthread_mutex_unlock(&s->lock);
+	}
+	/* the files are spread evenly over the shards, so taking the next one
+	 * of each shard in turn comes close to the order of a single policy */
+	for (j = 0, more = 1; more; j++) {
+		more = 0;
+		for (i = 0; i < cache->nr_shards; i++) {
+			if (j < sf[i].nr) {
+				fn(arg, sf[i].files[j]);
+				file_data_put(sf[i].files[j]);
+				more = 1;
+			}
+		}
+	}
+	for (i = 0; i < cache->nr_shards; i++) {
+		free(sf[i].files);
+	}
+	free(sf);
+}
+
+/* returns the number of buckets of t, and updates the longest chain seen */
+static int
+table_stats(struct cache_table *t, int *longest_chain)
+{
+	int i, len;
+
+	for (i = 0; i < t->size; i++) {
+		struct cache_entry *e = atomic_load(&t->buckets[i]);
+		for (len = 0; e != NULL; len++) {
+			e = atomic_load(&e->hash_next);
+		}
+		if (len > *longest_chain) {
+			*longest_chain = len;
+		}
+	}
+	return t->size;
+}
+
+void
+cache_print_stats(struct cache *cache)
+{
+	long hits = 0, misses = 0, hit_bytes = 0, miss_bytes = 0;
+	int nr_entries = 0, nr_buckets = 0, longest_chain = 0;
+	int i;
+
+	for (i = 0; i < cache->nr_shards; i++) {
+		struct cache_shard *s = &cache->shards[i];
+
+		hits += atomic_load(&s->hits);
+		misses += atomic_load(&s->misses);
+		hit_bytes += atomic_load(&s->hit_bytes);
+		miss_bytes += atomic_load(&s->miss_bytes);
+		pthread_mutex_lock(&s->lock);
+		nr_entries += s->nr_entries;
+		nr_buckets += table_stats(atomic_load(&s->table),
+					  &longest_chain);
+		if (atomic_load(&s->old_table) != NULL) {
+			nr_buckets += table_stats(atomic_load(&s->old_table),
+						  &longest_chain);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	printf("cache: policy = %s, hits = %ld, misses = %ld, "
+	       "hit ratio = %.4f, byte hit ratio = %.4f\n",
+	       cache->policy->name, hits, misses,
+	       hits + misses ? (double)hits / (hits + misses) : 0,
+	       hit_bytes + miss_bytes ?
+	       (double)hit_bytes / (hit_bytes + miss_bytes) : 0);
+	printf("cache: files = %d, buckets = %d, longest chain = %d\n",
+	       nr_entries, nr_buckets, longest_chain);
+}
+
+/* frees a table along with the files in it */
+static void
+table_destroy(struct cache_table *t)
+{
+	int i;
+
+	for (i = 0; i < t->size; i++) {
+		struct cache_entry *e = atomic_load(&t->buckets[i]);
+		while (e != NULL) {
+			struct cache_entry *next;
+			next = atomic_load(&e->hash_next);
+			entry_free(e);
+			e = next;
+		}
+	}
+	free(t);
+}
+
+/* frees the cache along with all the files it holds, no thread may be using
+ * the cache anymore */
+void
+cache_destroy(struct cache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->nr_shards; i++) {
+		struct cache_shard *s = &cache->shards[i];
+
+		table_destroy(atomic_load(&s->table));
+		if (atomic_load(&s->old_table) != NULL) {
+			table_destroy(atomic_load(&s->old_table));
+		}
+		cache->policy->destroy(s->policy);
+		ebr_flush(&s->limbo);
+		assert(s->loads == NULL);
+		pthread_cond_destroy(&s->load_done);
+		pthread_mutex_destroy(&s->lock);
+	}
+	free(cache->shards);
+	free(cache);
+}
@@ -0,0 +1,51 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+struct file_data;
+struct cache;
+
+/* cache settings other than its size */
+struct cache_config {
+	/* name of the replacement policy, one of "lru", "clock", "arc",
+	 * "tinylfu" or "gdsf", see cache_policy.c. lookups with "clock" take
+	 * no lock at all, the other policies lock a shard of the cache. */
+	char *policy;
+	/* larger files are never cached, 0 for no limit */
+	int max_file_size;
+	/* how much gdsf favors small files. 1 maximizes the request hit
+	 * ratio, 0 ignores file sizes which maximizes the byte hit ratio. */
+	double size_weight;
+};
+
+int cache_policy_valid(char *policy);
+struct cache *cache_init(int max_cache_size, struct cache_config *config);
+/* returns the cached file pinned, unpin it with file_data_put when done */
+struct file_data *cache_lookup(struct cache *c, char *file_name);
+/* the cache takes its own reference on an inserted file */
+void cache_insert(struct cache *c, struct file_data *data);
+/* like cache_lookup, but only one of the threads that miss on the same file
+ * loads it. the first one gets NULL with *loader set, and must call
+ * cache_load_done with the loaded file, or NULL if the load failed. the
+ * others wait for that load and get its result pinned, or NULL (with *loader
+ * clear) if it failed. */
+struct file_data *cache_lookup_load(struct cache *c, char *file_name,
+				    int *loader);
+void cache_load_done(struct cache *c, char *file_name, struct file_data *data);
+/* starts loading a file that no request asked for, to warm up the cache.
+ * returns 1 if it is neither cached nor being loaded, and the caller must then
+ * call cache_preload_done like cache_load_done. preloads are not counted as
+ * lookups, and the policy doesn't see them as accesses. */
+int cache_preload_start(struct cache *c, char *file_name);
+void cache_preload_done(struct cache *c, char *file_name,
+			struct file_data *data);
+/* calls fn on every cached file, the ones that the policy would evict last
+ * first */
+void cache_walk(struct cache *c, void (*fn)(void *arg, struct file_data *data),
+		void *arg);
+/* files larger than this are never cached */
+int cache_max_file_size(struct cache *c);
+/* prints request and byte hit ratios and the hash table size on stdout */
+void cache_print_stats(struct cache *c);
+void cache_destroy(struct cache *c);
+
+#endif /* __CACHE_H__ */
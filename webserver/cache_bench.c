@@ -0,0 +1,224 @@
+/*
+ * cache_bench.c: Microbenchmark for the file cache.
+ *
+ * To run:
+ *  cache_bench [nr_lookups [max_threads]]
+ *
+ * Fills the cache with 1k, 10k, 100k and 1M small files and measures the
+ * average latency of a cache hit for each cache population. Then measures the
+ * hit throughput of 1, 2, 4, ... max_threads threads looking up files in a
+ * cache of 100k files. Both are run for every cache replacement policy, the
+ * lock-free CLOCK policy against the policies that lock on a hit.
+ *
+ * Finally, measures the hit latency with 100k files whose names share ever
+ * longer directory prefixes, where comparing file names costs the most.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+
+#define DEFAULT_NR_LOOKUPS 1000000
+#define MAX_NR_ENTRIES 1000000
+#define THREADS_NR_ENTRIES 100000
+#define PREFIX_NR_ENTRIES 100000
+#define MAX_PREFIX_LEN 1024
+
+struct bench_thread {
+	struct cache *c;
+	char **names;
+	int nr_entries;
+	int nr_lookups;
+	unsigned int seed;
+};
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+static char *policies[] = { "lru", "clock", "arc", "tinylfu", "gdsf" };
+
+static struct cache *
+bench_cache_init(char **names, int nr_entries, char *policy)
+{
+	struct cache_config config = { policy, 0, 1 };
+	struct cache *c;
+	int i;
+
+	/* every file is one byte, so the cache never needs to evict. the large
+	 * cache size lets the cache use all its shards. */
+	c = cache_init(1 << 30, &config);
+	for (i = 0; i < nr_entries; i++) {
+		struct file_data *data = file_data_init();
+		file_data_set_name(data, names[i]);
+		data->file_size = 1;
+		cache_insert(c, data);
+		file_data_put(data);
+	}
+	return c;
+}
+
+/* random() takes a global lock, so each thread uses its own generator */
+static void *
+bench_lookups(void *arg)
+{
+	struct bench_thread *bt = arg;
+	int i;
+
+	for (i = 0; i < bt->nr_lookups; i++) {
+		int fnr = rand_r(&bt->seed) % bt->nr_entries;
+		struct file_data *data;
+
+		data = cache_lookup(bt->c, bt->names[fnr]);
+		assert(data);
+		file_data_put(data);
+	}
+	return NULL;
+}
+
+/* returns the average ns per hit */
+static double
+bench_latency(char **names, int nr_entries, int nr_lookups, char *policy)
+{
+	struct bench_thread bt = { NULL, names, nr_entries, nr_lookups, 1 };
+	struct timespec start, end;
+
+	bt.c = bench_cache_init(names, nr_entries, policy);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bench_lookups(&bt);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	cache_destroy(bt.c);
+	return elapsed_ns(&start, &end) / nr_lookups;
+}
+
+static void
+bench_throughput(struct cache *c, char **names, int nr_threads,
+		 int nr_lookups, char *policy)
+{
+	struct bench_thread *bt;
+	pthread_t *threads;
+	struct timespec start, end;
+	int i;
+
+	bt = Malloc(sizeof(struct bench_thread) * nr_threads);
+	threads = Malloc(sizeof(pthread_t) * nr_threads);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_threads; i++) {
+		bt[i].c = c;
+		bt[i].names = names;
+		bt[i].nr_entries = THREADS_NR_ENTRIES;
+		bt[i].nr_lookups = nr_lookups;
+		bt[i].seed = i + 1;
+		SYS(pthread_create(&threads[i], NULL, bench_lookups, &bt[i]));
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%s, %d, %.2f\n", policy, nr_threads,
+	       (double)nr_lookups * nr_threads / elapsed_ns(&start, &end) * 1e3);
+	free(threads);
+	free(bt);
+}
+
+/* returns copies of the names moved into a directory with a name of
+ * prefix_len characters, such as ./fileset_dir/aaaa...aaaa/0000001 */
+static char **
+prefix_names(char **names, int prefix_len)
+{
+	char **long_names = Malloc(sizeof(char *) * PREFIX_NR_ENTRIES);
+	char prefix[MAX_PREFIX_LEN + 1];
+	int i;
+
+	memset(prefix, 'a', prefix_len);
+	prefix[prefix_len] = 0;
+	for (i = 0; i < PREFIX_NR_ENTRIES; i++) {
+		/* skip the ./fileset_dir/ of the short name */
+		long_names[i] = Malloc(strlen(names[i]) + prefix_len + 2);
+		sprintf(long_names[i], "./fileset_dir/%s/%s", prefix,
+			names[i] + 14);
+	}
+	return long_names;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nr_lookups = DEFAULT_NR_LOOKUPS;
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int nr_entries, nr_threads, prefix_len;
+	struct cache *c;
+	char **names;
+	int i, p;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [nr_lookups [max_threads]]\n",
+			argv[0]);
+		exit(1);
+	}
+	if (argc >= 2) {
+		nr_lookups = atoi(argv[1]);
+	}
+	if (argc == 3) {
+		max_threads = atoi(argv[2]);
+	}
+	if (nr_lookups <= 0 || max_threads <= 0) {
+		fprintf(stderr, "arguments should be > 0\n");
+		exit(1);
+	}
+
+	names = Malloc(sizeof(char *) * MAX_NR_ENTRIES);
+	for (i = 0; i < MAX_NR_ENTRIES; i++) {
+		char buf[32];
+		sprintf(buf, "./fileset_dir/%07d", i);
+		names[i] = strdup(buf);
+	}
+
+	printf("# policy, entries, ns per hit\n");
+	for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+		for (nr_entries = 1000; nr_entries <= MAX_NR_ENTRIES;
+		     nr_entries *= 10) {
+			printf("%s, %d, %.1f\n", policies[p], nr_entries,
+			       bench_latency(names, nr_entries, nr_lookups,
+					     policies[p]));
+		}
+	}
+
+	printf("# policy, threads, million hits per second\n");
+	for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+		c = bench_cache_init(names, THREADS_NR_ENTRIES, policies[p]);
+		for (nr_threads = 1; nr_threads <= max_threads;
+		     nr_threads *= 2) {
+			bench_throughput(c, names, nr_threads, nr_lookups,
+					 policies[p]);
+		}
+		cache_destroy(c);
+	}
+
+	printf("# policy, name length, ns per hit\n");
+	for (prefix_len = 16; prefix_len <= MAX_PREFIX_LEN; prefix_len *= 4) {
+		char **long_names = prefix_names(names, prefix_len);
+
+		for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+			printf("%s, %d, %.1f\n", policies[p],
+			       (int)strlen(long_names[0]),
+			       bench_latency(long_names, PREFIX_NR_ENTRIES,
+					     nr_lookups, policies[p]));
+		}
+		for (i = 0; i < PREFIX_NR_ENTRIES; i++) {
+			free(long_names[i]);
+		}
+		free(long_names);
+	}
+
+	for (i = 0; i < MAX_NR_ENTRIES; i++) {
+		free(names[i]);
+	}
+	free(names);
+	exit(0);
+}
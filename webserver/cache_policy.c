@@ -0,0 +1,821 @@
+/*
+ * cache_policy.c: Replacement policies for the file cache.
+ *
+ *  lru     - exact least recently used.
+ *  clock   - CLOCK (second chance). Hits only set a reference bit, so cache
+ *            lookups need no lock.
+ *  arc     - Adaptive Replacement Cache. Balances a recency list (T1) against
+ *            a frequency list (T2), using ghost lists of recently evicted
+ *            files (B1, B2) to learn the split. Sizes are kept in bytes.
+ *  tinylfu - W-TinyLFU. New files enter a small LRU window. Files leaving the
+ *            window are only admitted into the main segmented LRU if a
+ *            count-min sketch says they are used more often than the file
+ *            they would replace, which keeps one-off scans out of the cache.
+ *  gdsf    - Greedy Dual Size Frequency. Evicts the file with the lowest
+ *            frequency / size^size_weight, aged so that files that stop being
+ *            used eventually go. A file is only admitted if it outranks all
+ *            the files it would evict, so a single large file can't flush
+ *            many small popular ones.
+ */
+
+#include "common.h"
+#include "cache.h"
+#include "ebr.h"
+#include "cache_policy.h"
+
+/* list of cache entries, first is the least recently used one */
+struct list {
+	struct cache_entry head;	/* sentinel */
+	long bytes;
+	int nr;
+};
+
+static void
+list_init(struct list *l)
+{
+	l->head.prev = &l->head;
+	l->head.next = &l->head;
+	l->bytes = 0;
+	l->nr = 0;
+}
+
+static struct cache_entry *
+list_first(struct list *l)
+{
+	return l->nr ? l->head.next : NULL;
+}
+
+static void
+list_remove(struct list *l, struct cache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	l->bytes -= e->size;
+	l->nr--;
+}
+
+/* add e at the most recently used end */
+static void
+list_push(struct list *l, struct cache_entry *e)
+{
+	e->prev = l->head.prev;
+	e->next = &l->head;
+	l->head.prev->next = e;
+	l->head.prev = e;
+	l->bytes += e->size;
+	l->nr++;
+}
+
+/* calls fn on the entries from the most recently used one */
+static void
+list_walk(struct list *l, void (*fn)(void *arg, struct cache_entry *e),
+	  void *arg)
+{
+	struct cache_entry *e;
+
+	for (e = l->head.prev; e != &l->head; e = e->prev) {
+		fn(arg, e);
+	}
+}
+
+/* spreads the key bits, the low bits of keys in a shard are all the same */
+static unsigned long
+mix(unsigned long key, int bits)
+{
+	return (key * 0x9e3779b97f4a7c15UL) >> (64 - bits);
+}
+
+/* smallest power of two >= n */
+static int
+pow2_bits(long n)
+{
+	int bits = 0;
+
+	while ((1L << bits) < n) {
+		bits++;
+	}
+	return bits;
+}
+
+/**************************
+ * LRU
+ **************************/
+
+static void *
+lru_init(int shard_size, struct cache_config *config)
+{
+	struct list *l = Malloc(sizeof(struct list));
+
+	list_init(l);
+	return l;
+}
+
+static void
+lru_destroy(void *p)
+{
+	free(p);
+}
+
+static void
+lru_access(void *p, unsigned long key, struct cache_entry *e)
+{
+	if (e) {
+		list_remove(p, e);
+		list_push(p, e);
+	}
+}
+
+static int
+lru_admit(void *p, unsigned long key, int size)
+{
+	return 1;
+}
+
+static void
+lru_insert(void *p, struct cache_entry *e)
+{
+	list_push(p, e);
+}
+
+static struct cache_entry *
+lru_evict(void *p)
+{
+	struct cache_entry *e = list_first(p);
+
+	list_remove(p, e);
+	return e;
+}
+
+/* also the clock's order, ignoring the reference bits */
+static void
+lru_walk(void *p, void (*fn)(void *arg, struct cache_entry *e), void *arg)
+{
+	list_walk(p, fn, arg);
+}
+
+/**************************
+ * CLOCK
+ **************************/
+
+/* called without the shard lock on a hit */
+static void
+clock_access(void *p, unsigned long key, struct cache_entry *e)
+{
+	/* avoid dirtying the cache line when the bit is already set */
+	if (e && !atomic_load_explicit(&e->referenced, memory_order_relaxed)) {
+		atomic_store_explicit(&e->referenced, 1, memory_order_relaxed);
+	}
+}
+
+static void
+clock_insert(void *p, struct cache_entry *e)
+{
+	atomic_store(&e->referenced, 0);
+	list_push(p, e);
+}
+
+/* the list is the clock, referenced files go around once more */
+static struct cache_entry *
+clock_evict(void *p)
+{
+	struct cache_entry *e;
+
+	while (1) {
+		e = list_first(p);
+		list_remove(p, e);
+		if (!atomic_exchange(&e->referenced, 0)) {
+			return e;
+		}
+		list_push(p, e);
+	}
+}
+
+/**************************
+ * ARC
+ **************************/
+
+enum { ARC_T1, ARC_T2 };
+
+/* a recently evicted file, only its key and size are remembered */
+struct arc_ghost {
+	unsigned long key;
+	int size;
+	int list;	/* B1 or B2 */
+	struct arc_ghost *prev;
+	struct arc_ghost *next;
+	struct arc_ghost *hash_next;
+};
+
+struct ghost_list {
+	struct arc_ghost head;	/* sentinel */
+	long bytes;
+};
+
+struct arc {
+	long c;		/* shard size */
+	long p;		/* target size of T1 */
+	struct list t[2];
+	struct ghost_list b[2];
+	int ghost_bits;
+	struct arc_ghost **ghosts;	/* hash table of B1 and B2 */
+	int incoming;	/* list that the file being inserted goes to */
+	int incoming_b2;	/* the file being inserted was in B2 */
+};
+
+static void *
+arc_init(int shard_size, struct cache_config *config)
+{
+	struct arc *a = Malloc(sizeof(struct arc));
+	int i;
+
+	a->c = shard_size;
+	a->p = 0;
+	for (i = 0; i < 2; i++) {
+		list_init(&a->t[i]);
+		a->b[i].head.prev = &a->b[i].head;
+		a->b[i].head.next = &a->b[i].head;
+		a->b[i].bytes = 0;
+	}
+	/* the ghost lists hold up to shard_size bytes, assume 4K files */
+	a->ghost_bits = pow2_bits(shard_size / 4096 + 64);
+	a->ghosts = Malloc(sizeof(struct arc_ghost *) << a->ghost_bits);
+	for (i = 0; i < (1 << a->ghost_bits); i++) {
+		a->ghosts[i] = NULL;
+	}
+	a->incoming = ARC_T1;
+	a->incoming_b2 = 0;
+	return a;
+}
+
+static struct arc_ghost **
+arc_ghost_find(struct arc *a, unsigned long key)
+{
+	struct arc_ghost **link = &a->ghosts[mix(key, a->ghost_bits)];
+
+	while (*link != NULL && (*link)->key != key) {
+		link = &(*link)->hash_next;
+	}
+	return link;
+}
+
+static void
+arc_ghost_remove(struct arc *a, struct arc_ghost *g)
+{
+	struct arc_ghost **link = arc_ghost_find(a, g->key);
+
+	*link = g->hash_next;
+	g->prev->next = g->next;
+	g->next->prev = g->prev;
+	a->b[g->list].bytes -= g->size;
+	free(g);
+}
+
+/* drop the oldest ghosts so that |T1| + |B1| <= c and the total <= 2c */
+static void
+arc_ghost_trim(struct arc *a)
+{
+	struct ghost_list *b1 = &a->b[ARC_T1], *b2 = &a->b[ARC_T2];
+
+	while (a->t[ARC_T1].bytes + b1->bytes > a->c &&
+	       b1->head.next != &b1->head) {
+		arc_ghost_remove(a, b1->head.next);
+	}
+	while (a->t[ARC_T1].bytes + a->t[ARC_T2].bytes + b1->bytes +
+	       b2->bytes > 2 * a->c && b2->head.next != &b2->head) {
+		arc_ghost_remove(a, b2->head.next);
+	}
+}
+
+static void
+arc_destroy(void *p)
+{
+	struct arc *a = p;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		while (a->b[i].head.next != &a->b[i].head) {
+			arc_ghost_remove(a, a->b[i].head.next);
+		}
+	}
+	free(a->ghosts);
+	free(a);
+}
+
+static void
+arc_access(void *p, unsigned long key, struct cache_entry *e)
+{
+	struct arc *a = p;
+
+	if (e) {
+		list_remove(&a->t[e->list], e);
+		e->list = ARC_T2;
+		list_push(&a->t[ARC_T2], e);
+	}
+}
+
+/* a miss on a ghost tells ARC which list should have been larger */
+static int
+arc_admit(void *p, unsigned long key, int size)
+{
+	struct arc *a = p;
+	struct arc_ghost *g = *arc_ghost_find(a, key);
+	long b1 = a->b[ARC_T1].bytes, b2 = a->b[ARC_T2].bytes;
+
+	a->incoming = ARC_T1;
+	a->incoming_b2 = 0;
+	if (g == NULL) {
+		return 1;
+	}
+	if (g->list == ARC_T1) {
+		a->p += (b1 > 0 && b2 > b1 ? b2 / b1 : 1) * size;
+		if (a->p > a->c) {
+			a->p = a->c;
+		}
+	} else {
+		a->p -= (b2 > 0 && b1 > b2 ? b1 / b2 : 1) * size;
+		if (a->p < 0) {
+			a->p = 0;
+		}
+		a->incoming_b2 = 1;
+	}
+	a->incoming = ARC_T2;
+	arc_ghost_remove(a, g);
+	return 1;
+}
+
+static void
+arc_insert(void *p, struct cache_entry *e)
+{
+	struct arc *a = p;
+
+	e->list = a->incoming;
+	list_push(&a->t[e->list], e);
+	arc_ghost_trim(a);
+}
+
+static struct cache_entry *
+arc_evict(void *p)
+{
+	struct arc *a = p;
+	struct cache_entry *e;
+	struct arc_ghost *g;
+	long t1 = a->t[ARC_T1].bytes;
+	int from;
+
+	if (t1 > 0 && (t1 > a->p || (a->incoming_b2 && t1 == a->p) ||
+		       a->t[ARC_T2].nr == 0)) {
+		from = ARC_T1;
+	} else {
+		from = ARC_T2;
+	}
+	e = list_first(&a->t[from]);
+	list_remove(&a->t[from], e);
+
+	/* remember the evicted file in the matching ghost list */
+	g = *arc_ghost_find(a, e->key);
+	if (g != NULL) {
+		/* hash collision with an older ghost, keep the new one */
+		arc_ghost_remove(a, g);
+	}
+	g = Malloc(sizeof(struct arc_ghost));
+	g->key = e->key;
+	g->size = e->size;
+	g->list = from;
+	g->prev = a->b[from].head.prev;
+	g->next = &a->b[from].head;
+	a->b[from].head.prev->next = g;
+	a->b[from].head.prev = g;
+	a->b[from].bytes += g->size;
+	g->hash_next = NULL;
+	*arc_ghost_find(a, g->key) = g;
+	arc_ghost_trim(a);
+	return e;
+}
+
+/* the frequent files, then the recent ones */
+static void
+arc_walk(void *p, void (*fn)(void *arg, struct cache_entry *e), void *arg)
+{
+	struct arc *a = p;
+
+	list_walk(&a->t[ARC_T2], fn, arg);
+	list_walk(&a->t[ARC_T1], fn, arg);
+}
+
+/**************************
+ * W-TinyLFU
+ **************************/
+
+enum { TLFU_WINDOW, TLFU_PROBATION, TLFU_PROTECTED };
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX 15	/* counters saturate, like 4-bit counters */
+
+/* count-min sketch of how often each key was accessed recently */
+struct sketch {
+	int bits;		/* each row has 1 << bits counters */
+	unsigned char *counters;
+	long additions;
+	long sample_size;	/* counters are halved after this many adds */
+};
+
+struct tinylfu {
+	long window_size;
+	long main_size;
+	long protected_size;
+	struct list lists[3];
+	struct sketch sketch;
+};
+
+static const unsigned long sketch_seeds[SKETCH_DEPTH] = {
+	0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL,
+	0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL,
+};
+
+static unsigned char *
+sketch_counter(struct sketch *sk, int row, unsigned long key)
+{
+	unsigned long idx = ((key ^ (key >> 29)) * sketch_seeds[row]) >>
+		(64 - sk->bits);
+	return &sk->counters[((long)row << sk->bits) + idx];
+}
+
+static void
+sketch_increment(struct sketch *sk, unsigned long key)
+{
+	long i;
+
+	for (i = 0; i < SKETCH_DEPTH; i++) {
+		unsigned char *c = sketch_counter(sk, i, key);
+		if (*c < SKETCH_MAX) {
+			(*c)++;
+		}
+	}
+	/* age the counts so that the sketch follows changes in popularity */
+	if (++sk->additions >= sk->sample_size) {
+		for (i = 0; i < ((long)SKETCH_DEPTH << sk->bits); i++) {
+			sk->counters[i] >>= 1;
+		}
+		sk->additions /= 2;
+	}
+}
+
+static int
+sketch_estimate(struct sketch *sk, unsigned long key)
+{
+	int i, min = SKETCH_MAX;
+
+	for (i = 0; i < SKETCH_DEPTH; i++) {
+		unsigned char *c = sketch_counter(sk, i, key);
+		if (*c < min) {
+			min = *c;
+		}
+	}
+	return min;
+}
+
+/* assume 4K files to size the sketch for the number of cached files */
+static void
+sketch_init(struct sketch *sk, int shard_size)
+{
+	sk->bits = pow2_bits(shard_size / 4096 + 256);
+	sk->counters = Malloc((long)SKETCH_DEPTH << sk->bits);
+	memset(sk->counters, 0, (long)SKETCH_DEPTH << sk->bits);
+	sk->additions = 0;
+	sk->sample_size = 10L << sk->bits;
+}
+
+static void *
+tinylfu_init(int shard_size, struct cache_config *config)
+{
+	struct tinylfu *t = Malloc(sizeof(struct tinylfu));
+	int i;
+
+	/* 1% window, the main area is 20% probation and 80% protected */
+	t->window_size = shard_size / 100;
+	t->main_size = shard_size - t->window_size;
+	t->protected_size = t->main_size * 80 / 100;
+	for (i = 0; i < 3; i++) {
+		list_init(&t->lists[i]);
+	}
+	sketch_init(&t->sketch, shard_size);
+	return t;
+}
+
+static void
+tinylfu_destroy(void *p)
+{
+	struct tinylfu *t = p;
+
+	free(t->sketch.counters);
+	free(t);
+}
+
+static void
+tinylfu_move(struct tinylfu *t, struct cache_entry *e, int to)
+{
+	list_remove(&t->lists[e->list], e);
+	e->list = to;
+	list_push(&t->lists[to], e);
+}
+
+static void
+tinylfu_access(void *p, unsigned long key, struct cache_entry *e)
+{
+	struct tinylfu *t = p;
+	struct list *protected = &t->lists[TLFU_PROTECTED];
+
+	sketch_increment(&t->sketch, key);
+	if (e == NULL) {
+		return;
+	}
+	/* a hit in probation promotes the file to protected, which may push
+	 * the least recently used protected files back to probation */
+	tinylfu_move(t, e, e->list == TLFU_WINDOW ? TLFU_WINDOW :
+		     TLFU_PROTECTED);
+	while (protected->bytes > t->protected_size && protected->nr > 1) {
+		tinylfu_move(t, list_first(protected), TLFU_PROBATION);
+	}
+}
+
+static struct cache_entry *
+tinylfu_main_victim(struct tinylfu *t)
+{
+	struct cache_entry *e = list_first(&t->lists[TLFU_PROBATION]);
+
+	return e ? e : list_first(&t->lists[TLFU_PROTECTED]);
+}
+
+static void
+tinylfu_insert(void *p, struct cache_entry *e)
+{
+	struct tinylfu *t = p;
+	struct list *window = &t->lists[TLFU_WINDOW];
+
+	e->list = TLFU_WINDOW;
+	list_push(window, e);
+	/* files leaving the window move to probation while there is room */
+	while (window->bytes > t->window_size && window->nr > 1) {
+		struct cache_entry *candidate = list_first(window);
+		if (t->lists[TLFU_PROBATION].bytes +
+		    t->lists[TLFU_PROTECTED].bytes + candidate->size >
+		    t->main_size) {
+			break;
+		}
+		tinylfu_move(t, candidate, TLFU_PROBATION);
+	}
+}
+
+static struct cache_entry *
+tinylfu_evict(void *p)
+{
+	struct tinylfu *t = p;
+	struct list *window = &t->lists[TLFU_WINDOW];
+	struct cache_entry *candidate = NULL, *victim;
+
+	if (window->nr > 0 && window->bytes > t->window_size) {
+		candidate = list_first(window);
+	}
+	victim = tinylfu_main_victim(t);
+	if (victim == NULL) {
+		victim = list_first(window);
+	} else if (candidate) {
+		/* the window candidate and the main victim compete, the less
+		 * frequently used one is evicted */
+		if (sketch_estimate(&t->sketch, candidate->key) >
+		    sketch_estimate(&t->sketch, victim->key)) {
+			tinylfu_move(t, candidate, TLFU_PROBATION);
+		} else {
+			victim = candidate;
+		}
+	}
+	list_remove(&t->lists[victim->list], victim);
+	return victim;
+}
+
+/* probation is evicted from first */
+static void
+tinylfu_walk(void *p, void (*fn)(void *arg, struct cache_entry *e),
+	     void *arg)
+{
+	struct tinylfu *t = p;
+
+	list_walk(&t->lists[TLFU_PROTECTED], fn, arg);
+	list_walk(&t->lists[TLFU_WINDOW], fn, arg);
+	list_walk(&t->lists[TLFU_PROBATION], fn, arg);
+}
+
+/**************************
+ * GDSF
+ **************************/
+
+/* the files are kept in a binary min-heap ordered by priority, the heap index
+ * of a file is kept in its list field. frequencies come from a count-min
+ * sketch, so files that were evicted keep their history. */
+struct gdsf {
+	long shard_size;
+	long bytes;		/* bytes of the cached files */
+	double size_weight;
+	double inflation;	/* priority of the last evicted file */
+	double incoming;	/* priority of the file being inserted */
+	struct cache_entry **heap;
+	int nr;
+	int heap_size;
+	struct sketch sketch;
+};
+
+static void *
+gdsf_init(int shard_size, struct cache_config *config)
+{
+	struct gdsf *g = Malloc(sizeof(struct gdsf));
+
+	g->shard_size = shard_size;
+	g->bytes = 0;
+	g->size_weight = config->size_weight;
+	g->inflation = 0;
+	g->incoming = 0;
+	g->heap_size = 1024;
+	g->heap = Malloc(sizeof(struct cache_entry *) * g->heap_size);
+	g->nr = 0;
+	sketch_init(&g->sketch, shard_size);
+	return g;
+}
+
+static void
+gdsf_destroy(void *p)
+{
+	struct gdsf *g = p;
+
+	free(g->sketch.counters);
+	free(g->heap);
+	free(g);
+}
+
+static double
+gdsf_priority(struct gdsf *g, unsigned long key, int size)
+{
+	return g->inflation + sketch_estimate(&g->sketch, key) /
+		pow(size > 1 ? size : 1, g->size_weight);
+}
+
+static void
+gdsf_set(struct gdsf *g, int i, struct cache_entry *e)
+{
+	g->heap[i] = e;
+	e->list = i;
+}
+
+/* moves the entry at index i up or down until the heap is ordered again */
+static void
+gdsf_fix(struct gdsf *g, int i)
+{
+	struct cache_entry *e = g->heap[i];
+
+	while (i > 0 && g->heap[(i - 1) / 2]->priority > e->priority) {
+		gdsf_set(g, i, g->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	while (2 * i + 1 < g->nr) {
+		int child = 2 * i + 1;
+		if (child + 1 < g->nr &&
+		    g->heap[child + 1]->priority < g->heap[child]->priority) {
+			child++;
+		}
+		if (g->heap[child]->priority >= e->priority) {
+			break;
+		}
+		gdsf_set(g, i, g->heap[child]);
+		i = child;
+	}
+	gdsf_set(g, i, e);
+}
+
+static void
+gdsf_access(void *p, unsigned long key, struct cache_entry *e)
+{
+	struct gdsf *g = p;
+
+	sketch_increment(&g->sketch, key);
+	if (e) {
+		e->priority = gdsf_priority(g, key, e->size);
+		gdsf_fix(g, e->list);
+	}
+}
+
+/* sums up the sizes of the files in the subtree at index i whose priority is
+ * below priority, stopping once need bytes are found. these files are at the
+ * top of the heap, so they are the next ones to be evicted. */
+static long
+gdsf_below(struct gdsf *g, int i, double priority, long need)
+{
+	long sum;
+
+	if (i >= g->nr || g->heap[i]->priority >= priority) {
+		return 0;
+	}
+	sum = g->heap[i]->size;
+	if (sum < need) {
+		sum += gdsf_below(g, 2 * i + 1, priority, need - sum);
+	}
+	if (sum < need) {
+		sum += gdsf_below(g, 2 * i + 2, priority, need - sum);
+	}
+	return sum;
+}
+
+static int
+gdsf_admit(void *p, unsigned long key, int size)
+{
+	struct gdsf *g = p;
+	long need = g->bytes + size - g->shard_size;
+
+	g->incoming = gdsf_priority(g, key, size);
+	return need <= 0 || gdsf_below(g, 0, g->incoming, need) >= need;
+}
+
+static void
+gdsf_insert(void *p, struct cache_entry *e)
+{
+	struct gdsf *g = p;
+
+	if (g->nr == g->heap_size) {
+		struct cache_entry **heap;
+		heap = Malloc(sizeof(struct cache_entry *) * g->heap_size * 2);
+		memcpy(heap, g->heap, sizeof(struct cache_entry *) * g->nr);
+		free(g->heap);
+		g->heap = heap;
+		g->heap_size *= 2;
+	}
+	e->priority = g->incoming;
+	gdsf_set(g, g->nr++, e);
+	gdsf_fix(g, e->list);
+	g->bytes += e->size;
+}
+
+static struct cache_entry *
+gdsf_evict(void *p)
+{
+	struct gdsf *g = p;
+	struct cache_entry *e = g->heap[0];
+
+	/* files inserted from now on start from the evicted priority */
+	g->inflation = e->priority;
+	g->bytes -= e->size;
+	if (--g->nr > 0) {
+		gdsf_set(g, 0, g->heap[g->nr]);
+		gdsf_fix(g, 0);
+	}
+	return e;
+}
+
+static int
+gdsf_compare(const void *a, const void *b)
+{
+	double pa = (*(struct cache_entry **)a)->priority;
+	double pb = (*(struct cache_entry **)b)->priority;
+
+	return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+/* the heap is only ordered from the root down, so a copy is sorted */
+static void
+gdsf_walk(void *p, void (*fn)(void *arg, struct cache_entry *e), void *arg)
+{
+	struct gdsf *g = p;
+	struct cache_entry **sorted;
+	int i;
+
+	sorted = Malloc(sizeof(struct cache_entry *) * (g->nr + 1));
+	memcpy(sorted, g->heap, sizeof(struct cache_entry *) * g->nr);
+	qsort(sorted, g->nr, sizeof(struct cache_entry *), gdsf_compare);
+	for (i = 0; i < g->nr; i++) {
+		fn(arg, sorted[i]);
+	}
+	free(sorted);
+}
+
+static struct cache_policy policies[] = {
+	{ "lru", 0, lru_init, lru_destroy, lru_access, lru_admit,
+	  lru_insert, lru_evict, lru_walk },
+	{ "clock", 1, lru_init, lru_destroy, clock_access, lru_admit,
+	  clock_insert, clock_evict, lru_walk },
+	{ "arc", 0, arc_init, arc_destroy, arc_access, arc_admit,
+	  arc_insert, arc_evict, arc_walk },
+	{ "tinylfu", 0, tinylfu_init, tinylfu_destroy, tinylfu_access,
+	  lru_admit, tinylfu_insert, tinylfu_evict, tinylfu_walk },
+	{ "gdsf", 0, gdsf_init, gdsf_destroy, gdsf_access, gdsf_admit,
+	  gdsf_insert, gdsf_evict, gdsf_walk },
+};
+
+struct cache_policy *
+cache_policy_find(char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		if (strcmp(policies[i].name, name) == 0) {
+			return &policies[i];
+		}
+	}
+	return NULL;
+}
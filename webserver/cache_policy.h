@@ -0,0 +1,51 @@
+#ifndef __CACHE_POLICY_H__
+#define __CACHE_POLICY_H__
+
+/* interface between the cache and its replacement policies */
+
+struct file_data;
+struct cache_config;
+
+/* the name of the file follows the entry in the same allocation, so that it
+ * can be compared without another cache miss */
+struct cache_entry {
+	struct file_data *data;
+	unsigned long key;	/* hash of the file name */
+	int name_len;
+	int size;		/* bytes charged to the cache */
+	/* next entry in the same hash bucket, owned by cache.c */
+	_Atomic(struct cache_entry *) hash_next;
+	struct ebr_node retired;	/* owned by cache.c */
+	/* the remaining fields are owned by the policy */
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	int list;		/* which of the policy's lists holds the entry,
+				 * or its index in the GDSF heap */
+	atomic_int referenced;	/* CLOCK reference bit */
+	double priority;	/* GDSF priority */
+};
+
+/* every policy manages one cache shard of shard_size bytes. all calls are made
+ * with the shard lock held, except for access on a hit when lockless is set.
+ * such policies must only touch atomic fields of the entry on a hit. */
+struct cache_policy {
+	char *name;
+	int lockless;
+	void *(*init)(int shard_size, struct cache_config *config);
+	void (*destroy)(void *p);
+	/* a lookup of key found entry e, or missed when e is NULL */
+	void (*access)(void *p, unsigned long key, struct cache_entry *e);
+	/* a file of size bytes is about to be inserted, returns 0 to keep it
+	 * out of the cache */
+	int (*admit)(void *p, unsigned long key, int size);
+	void (*insert)(void *p, struct cache_entry *e);
+	/* detaches and returns the next entry to evict */
+	struct cache_entry *(*evict)(void *p);
+	/* calls fn on every entry, the ones that would be evicted last first */
+	void (*walk)(void *p, void (*fn)(void *arg, struct cache_entry *e),
+		     void *arg);
+};
+
+struct cache_policy *cache_policy_find(char *name);
+
+#endif /* __CACHE_POLICY_H__ */
@@ -0,0 +1,144 @@
+/*
+ * checksum.c: Byte sum checksum of files and responses.
+ *
+ * The vector kernels use psadbw, which sums the absolute differences of
+ * unsigned bytes. Against a zero vector, that is the sum of each group of 8
+ * bytes in a 64-bit lane. The lanes are added up at the end, and only the low
+ * 32 bits of the total are the checksum.
+ *
+ * The vector kernels are compiled with target attributes, so that the rest of
+ * the program does not need AVX2, and are only used when CPUID says that the
+ * CPU supports them.
+ */
+
+#include "common.h"
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+static unsigned int
+checksum_scalar(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned int csum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		csum += p[i];
+	}
+	return csum;
+}
+
+#ifdef CHECKSUM_X86
+
+__attribute__((target("sse2")))
+static unsigned int
+checksum_sse2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	size_t i = 0;
+
+	/* four independent accumulators keep several psadbw in flight */
+	for (; i + 64 <= len; i += 64) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(p + i + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(p + i + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i *)(p + i + 48));
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(v0, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(v1, zero));
+		acc2 = _mm_add_epi64(acc2, _mm_sad_epu8(v2, zero));
+		acc3 = _mm_add_epi64(acc3, _mm_sad_epu8(v3, zero));
+	}
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(v, zero));
+	}
+	acc0 = _mm_add_epi64(_mm_add_epi64(acc0, acc1),
+			     _mm_add_epi64(acc2, acc3));
+	acc0 = _mm_add_epi64(acc0, _mm_unpackhi_epi64(acc0, acc0));
+	return (unsigned int)_mm_cvtsi128_si32(acc0) +
+		checksum_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+checksum_avx2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	__m128i acc;
+	size_t i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		__m256i v2 = _mm256_loadu_si256((const __m256i *)(p + i + 64));
+		__m256i v3 = _mm256_loadu_si256((const __m256i *)(p + i + 96));
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(v1, zero));
+		acc2 = _mm256_add_epi64(acc2, _mm256_sad_epu8(v2, zero));
+		acc3 = _mm256_add_epi64(acc3, _mm256_sad_epu8(v3, zero));
+	}
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v, zero));
+	}
+	acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1),
+				_mm256_add_epi64(acc2, acc3));
+	acc = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+			    _mm256_extracti128_si256(acc0, 1));
+	acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+	return (unsigned int)_mm_cvtsi128_si32(acc) +
+		checksum_scalar(p + i, len - i);
+}
+
+#endif /* CHECKSUM_X86 */
+
+static struct checksum_kernel kernels[] = {
+	{ "scalar", checksum_scalar },
+#ifdef CHECKSUM_X86
+	{ "sse2", checksum_sse2 },
+	{ "avx2", checksum_avx2 },
+#endif
+};
+
+static int nr_kernels;
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+/* counts the kernels that the CPU supports, they are sorted by the
+ * instruction set that they need */
+static void
+checksum_select(void)
+{
+	nr_kernels = 1;
+#ifdef CHECKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		nr_kernels = 2;
+		if (__builtin_cpu_supports("avx2")) {
+			nr_kernels = 3;
+		}
+	}
+#endif
+}
+
+struct checksum_kernel *
+checksum_kernels(int *nr)
+{
+	pthread_once(&checksum_once, checksum_select);
+	*nr = nr_kernels;
+	return kernels;
+}
+
+unsigned int
+checksum(const void *buf, size_t len)
+{
+	pthread_once(&checksum_once, checksum_select);
+	return kernels[nr_kernels - 1].sum(buf, len);
+}
@@ -0,0 +1,18 @@
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+/* the trivial checksum sent in the Content-Csum header: the sum of all the
+ * bytes, as unsigned chars, modulo 2^32 */
+unsigned int checksum(const void *buf, size_t len);
+
+/* the checksum is computed by the fastest kernel that the CPU supports */
+struct checksum_kernel {
+	char *name;
+	unsigned int (*sum)(const void *buf, size_t len);
+};
+
+/* returns the kernels that the CPU supports, slowest first. checksum uses the
+ * last one. */
+struct checksum_kernel *checksum_kernels(int *nr_kernels);
+
+#endif /* __CHECKSUM_H__ */
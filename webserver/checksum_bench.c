@@ -0,0 +1,97 @@
+/*
+ * checksum_bench.c: Microbenchmark for the checksum kernels.
+ *
+ * To run:
+ *  checksum_bench [seconds]
+ *
+ * Measures the throughput of every checksum kernel that the CPU supports, in
+ * GB/s on one core, for buffers that fit in the L1 cache, in the L2 cache and
+ * in memory. Also checks that all kernels compute the same checksum.
+ */
+
+#include "common.h"
+#include "checksum.h"
+
+#define MAX_BUF_SIZE (64 << 20)
+#define DEFAULT_SECONDS 0.5
+
+static double
+elapsed_s(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+		(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* sums buf repeatedly for about seconds, returns GB/s */
+static double
+bench_kernel(struct checksum_kernel *k, char *buf, size_t len, double seconds)
+{
+	struct timespec start, end;
+	volatile unsigned int sink;
+	long bytes = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		int i;
+		/* check the clock every 64MB at most */
+		for (i = 0; i < MAX_BUF_SIZE / len; i++) {
+			sink = k->sum(buf, len);
+		}
+		bytes += (long)i * len;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+	} while (elapsed_s(&start, &end) < seconds);
+	(void)sink;
+	return bytes / elapsed_s(&start, &end) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static size_t sizes[] = { 16 << 10, 256 << 10, MAX_BUF_SIZE };
+	double seconds = DEFAULT_SECONDS;
+	struct checksum_kernel *kernels;
+	int nr_kernels, i, k;
+	size_t len;
+	char *buf;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [seconds]\n", argv[0]);
+		exit(1);
+	}
+	if (argc == 2) {
+		seconds = atof(argv[1]);
+	}
+	if (seconds <= 0) {
+		fprintf(stderr, "seconds should be > 0\n");
+		exit(1);
+	}
+
+	buf = Malloc(MAX_BUF_SIZE);
+	for (len = 0; len < MAX_BUF_SIZE; len++) {
+		buf[len] = random();
+	}
+	kernels = checksum_kernels(&nr_kernels);
+
+	/* odd lengths and offsets exercise the tails of the vector loops */
+	for (len = 0; len < 1000; len++) {
+		unsigned int csum = kernels[0].sum(buf + len % 7, len);
+		for (k = 1; k < nr_kernels; k++) {
+			if (kernels[k].sum(buf + len % 7, len) != csum) {
+				fprintf(stderr, "%s: wrong checksum for %zu "
+					"bytes\n", kernels[k].name, len);
+				exit(1);
+			}
+		}
+	}
+
+	printf("# kernel, buffer size, GB/s\n");
+	for (k = 0; k < nr_kernels; k++) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			printf("%s, %zu, %.2f\n", kernels[k].name, sizes[i],
+			       bench_kernel(&kernels[k], buf, sizes[i],
+					    seconds));
+		}
+	}
+	free(buf);
+	exit(0);
+}
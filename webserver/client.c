@@ -1,37 +1,41 @@
 /*
  * client.c: A multi-threaded client for testing the HTTP server.
- * 
+ *
+ * With --keepalive, each thread sends all its requests over one HTTP/1.1
+ * connection, as long as the server keeps it open, instead of opening a
+ * connection per request.
  */
 
 #include "common.h"
+#include "checksum.h"
 
 /* send an HTTP request for the specified file */
 static void
-client_send(int fd, char *host, char *filename)
+client_send(int fd, char *host, char *filename, int keepalive)
 {
 	char buf[MAXLINE];
 
 	/* create the request line */
-	sprintf(buf, "GET %s HTTP/1.0\r\n", filename);
+	sprintf(buf, "GET %s HTTP/1.%d\r\n", filename, keepalive);
 	/* create one request header line for the server host, 
 	   and then the empty line */
 	sprintf(buf + strlen(buf), "host: %s\r\n\r\n", host);
 	Rio_write(fd, buf, strlen(buf));
 }
 
-/* read the HTTP response and print it out */
-static void
-client_print(int fd, unsigned int orig_csum, int orig_length, int print)
+/* read the HTTP response and print it out. returns 1 if the server keeps the
+ * connection open for the next request. */
+static int
+client_print(struct rio *rio, unsigned int orig_csum, int orig_length,
+	     int print)
 {
-	struct rio *rio;
 	char buf[MAXBUF];
-	int i, n;
+	int n;
 	int length = 0;
 	int length_received = 0;
 	unsigned int csum = 0;
 	unsigned int csum_received = 0;
-	
-	rio = Rio_init(fd);
+	int keepalive = 0;
 
 	/* read and display the HTTP header */
 	n = Rio_readlineb(rio, buf, MAXBUF);
@@ -48,19 +52,27 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 		if (sscanf(buf, "Content-Csum: %u ", &csum) == 1) {
 			/* found csum tag */
 		}
+		if (strncasecmp(buf, "Connection: keep-alive", 22) == 0) {
+			keepalive = 1;
+		}
 	}
 
 	fflush(stdout);
-	/* read and display the HTTP body */
+	/* read and display the HTTP body. on a persistent connection, the
+	 * body ends after Content-Length bytes, otherwise when the server
+	 * closes the connection. */
 	do {
-		n = Rio_readlineb(rio, buf, MAXBUF);
+		if (keepalive) {
+			n = length - length_received;
+			n = Rio_readnb(rio, buf, n < MAXBUF ? n : MAXBUF);
+		} else {
+			n = Rio_readlineb(rio, buf, MAXBUF);
+		}
 		if (print) {
 			Rio_write(STDOUT_FILENO, buf, n);
 		}
 		length_received += n;
-		for (i = 0; i < n; i++) {
-			csum_received += (unsigned char)buf[i];
-		}
+		csum_received += checksum(buf, n);
 	} while (n > 0);
 
 	assert(orig_csum == csum);
@@ -68,7 +80,7 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 
 	assert(length == length_received);
 	assert(csum == csum_received);
-	Rio_destroy(rio);
+	return keepalive;
 }
 
 struct fileinfo {
@@ -85,6 +97,7 @@ struct client {
 	struct fileinfo *fileset;
 	int nr_files;
 	int timing_mode;
+	int keepalive;
 };
 
 /* open a single connection to the specified host and port */
@@ -92,13 +105,17 @@ static void *
 client_request(void *arg)
 {
 	struct client *cl = (struct client *)arg;
-	int clientfd;
+	int clientfd = -1;
+	struct rio *rio = NULL;
 	int i;
 
 	for (i = 0; i < cl->nr_times; i++) {
 		int fnr;
 
-		clientfd = open_clientfd(cl->host, cl->port);
+		if (clientfd < 0) {
+			clientfd = open_clientfd(cl->host, cl->port);
+			rio = Rio_init(clientfd);
+		}
 		/* get a random file from the file set */
 		/* we used to use a self similar distribution but that allowed
 		 * using simplistic caching policies. Now we use a uniform
@@ -109,10 +126,19 @@ client_request(void *arg)
 		/* for debugging */
 		// fprintf(stderr, "requesting file: %s\n", 
 		// cl->fileset[fnr].name);
-		client_send(clientfd, cl->host, cl->fileset[fnr].name);
+		client_send(clientfd, cl->host, cl->fileset[fnr].name,
+			    cl->keepalive);
 		/* when timing_mode is 1, then don't print anything */
-		client_print(clientfd, cl->fileset[fnr].csum, 
-			     cl->fileset[fnr].len, (cl->timing_mode == 0));
+		if (!client_print(rio, cl->fileset[fnr].csum,
+				  cl->fileset[fnr].len,
+				  (cl->timing_mode == 0))) {
+			Rio_destroy(rio);
+			SYS(close(clientfd));
+			clientfd = -1;
+		}
+	}
+	if (clientfd >= 0) {
+		Rio_destroy(rio);
 		SYS(close(clientfd));
 	}
 	return NULL;
@@ -121,8 +147,8 @@ client_request(void *arg)
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s [-t] host port nr_times nr_threads fileset\n",
-		program);
+	fprintf(stderr, "Usage: %s [-t] [--keepalive] host port nr_times "
+		"nr_threads fileset\n", program);
 	exit(1);
 }
 
@@ -176,15 +202,19 @@ main(int argc, char *argv[])
 	struct client cl;
 	struct timeval start, end, diff;
 
-	if (argc != 6 && argc != 7) {
-		usage(argv[0]);
+	cl.timing_mode = 0;
+	cl.keepalive = 0;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-t") == 0) {
+			cl.timing_mode = 1;
+		} else if (strcmp(argv[i], "--keepalive") == 0) {
+			cl.keepalive = 1;
+		} else {
+			usage(argv[0]);
+		}
 	}
-	i = 1;
-	if (strcmp(argv[i], "-t") == 0) {
-		cl.timing_mode = 1;
-		i++;
-	} else {
-		cl.timing_mode = 0;
+	if (argc - i != 5) {
+		usage(argv[0]);
 	}
 	cl.host = argv[i++];
 	cl.port = atoi(argv[i++]);
@@ -215,8 +245,10 @@ main(int argc, char *argv[])
 	if (cl.timing_mode) {
 		gettimeofday(&end, NULL);
 		timersub(&end, &start, &diff);
-		printf("client runtime = %.6f seconds\n",
-			(float)diff.tv_sec + (float)diff.tv_usec / 1000000);
+		printf("client runtime = %.6f seconds, %.0f requests/sec\n",
+			(float)diff.tv_sec + (float)diff.tv_usec / 1000000,
+			(double)cl.nr_times * cl.nr_threads /
+			((double)diff.tv_sec + (double)diff.tv_usec / 1000000));
 	}
 	exit(0);
 }
@@ -164,6 +164,25 @@ rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 	return n;
 }
 
+/* rio_readnb - robustly read n bytes (buffered) */
+static ssize_t
+rio_readnb(struct rio *rp, void *usrbuf, size_t n)
+{
+	size_t nleft = n;
+	ssize_t nread;
+	char *bufp = usrbuf;
+
+	while (nleft > 0) {
+		if ((nread = rio_readb(rp, bufp, nleft)) < 0)
+			return -1;	/* errno set by read() */
+		else if (nread == 0)
+			break;		/* EOF */
+		nleft -= nread;
+		bufp += nread;
+	}
+	return (n - nleft);	/* return >= 0 */
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -209,6 +228,16 @@ Rio_readlineb(struct rio * rp, void *usrbuf, size_t maxlen)
 	return rc;
 }
 
+ssize_t
+Rio_readnb(struct rio *rp, void *usrbuf, size_t n)
+{
+	ssize_t rc;
+
+	if ((rc = rio_readnb(rp, usrbuf, n)) < 0)
+		unix_error("Rio_readnb error");
+	return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -267,9 +296,10 @@ open_clientfd(char *hostname, int port)
 	return clientfd;
 }
 
-/* open and return a listening socket on port */
+/* open and return a listening socket on port. with reuseport, other sockets
+ * with reuseport may listen on the same port. */
 int
-open_listenfd(int port)
+open_listenfd(int port, int reuseport)
 {
 	int listenfd, optval = 1;
 	struct sockaddr_in serveraddr;
@@ -281,6 +311,13 @@ open_listenfd(int port)
 	SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
 		       (const void *)&optval, sizeof(int)));
 
+	/* Lets several sockets listen on the same port, the kernel spreads
+	 * the incoming connections over them */
+	if (reuseport) {
+		SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+			       (const void *)&optval, sizeof(int)));
+	}
+
 	/* Listenfd will be an endpoint for all requests to port
 	   on any IP address for this host */
 	bzero((char *)&serveraddr, sizeof(serveraddr));
@@ -1,6 +1,11 @@
 #ifndef __CSAPP_H__
 #define __CSAPP_H__
 
+/* for accept4 and CPU affinity */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,6 +20,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -25,6 +32,11 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <limits.h>
 
 #define __STR(n) #n
 #define STR(n) __STR(n)
@@ -62,6 +74,9 @@
 #define MAXBUF   8192	/* max I/O buffer size */
 #define LISTENQ  1024	/* second argument to listen() */
 
+/* Error-handling functions */
+void unix_error(char *msg);
+
 /* Memory managment wrappers */
 void *Malloc(size_t size);
 
@@ -73,10 +88,11 @@ void Rio_destroy(struct rio *rp);
 ssize_t Rio_read(int fd, void *usrbuf, size_t n);
 void Rio_write(int fd, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readnb(struct rio *rp, void *usrbuf, size_t n);
 
 /* Wrappers for client/server helper functions */
 int open_clientfd(char *hostname, int port);
-int open_listenfd(int port);
+int open_listenfd(int port, int reuseport);
 
 /* Random functions */
 void init_random();
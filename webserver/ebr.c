@@ -0,0 +1,178 @@
+/*
+ * ebr.c: Epoch-based reclamation.
+ *
+ * Every thread that reads shared data without a lock does so between
+ * ebr_enter() and ebr_exit(), which publish the global epoch the thread
+ * observed. The global epoch only advances once all threads inside a
+ * read-side section have observed the current one. Memory retired during
+ * epoch e can therefore be freed once the global epoch reaches e + 2, since
+ * no reader can still hold a reference to it.
+ *
+ * Retired objects are kept on limbo lists owned by the caller, such as one
+ * per cache shard protected by the shard's lock, so retiring and freeing
+ * takes no lock of its own. The list node is embedded in the retired object.
+ */
+
+#include "common.h"
+#include "ebr.h"
+
+/* a thread's state is (epoch << 1) | active */
+struct ebr_thread {
+	_Atomic unsigned long state;
+	atomic_int in_use;
+	int depth;	/* nesting of ebr_enter calls */
+	struct ebr_thread *next;
+};
+
+static _Atomic unsigned long ebr_epoch = 0;
+/* thread records are never freed, records of exited threads are reused */
+static _Atomic(struct ebr_thread *) ebr_threads = NULL;
+static __thread struct ebr_thread *ebr_self = NULL;
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+/* called when a registered thread exits */
+static void
+ebr_thread_exit(void *arg)
+{
+	struct ebr_thread *t = arg;
+
+	atomic_store(&t->state, 0);
+	atomic_store(&t->in_use, 0);
+}
+
+static void
+ebr_key_init(void)
+{
+	SYS(pthread_key_create(&ebr_key, ebr_thread_exit));
+}
+
+static struct ebr_thread *
+ebr_register(void)
+{
+	struct ebr_thread *t;
+
+	pthread_once(&ebr_once, ebr_key_init);
+	for (t = atomic_load(&ebr_threads); t != NULL; t = t->next) {
+		int unused = 0;
+		if (atomic_compare_exchange_strong(&t->in_use, &unused, 1)) {
+			break;
+		}
+	}
+	if (t == NULL) {
+		t = Malloc(sizeof(struct ebr_thread));
+		atomic_init(&t->state, 0);
+		atomic_init(&t->in_use, 1);
+		t->next = atomic_load(&ebr_threads);
+		while (!atomic_compare_exchange_weak(&ebr_threads, &t->next, t))
+			;
+	}
+	t->depth = 0;
+	pthread_setspecific(ebr_key, t);
+	return t;
+}
+
+void
+ebr_enter(void)
+{
+	struct ebr_thread *t = ebr_self;
+
+	if (t == NULL) {
+		t = ebr_self = ebr_register();
+	}
+	if (t->depth++ == 0) {
+		/* seq_cst orders this store before any of the reader's loads */
+		atomic_store(&t->state, (atomic_load(&ebr_epoch) << 1) | 1);
+	}
+}
+
+void
+ebr_exit(void)
+{
+	struct ebr_thread *t = ebr_self;
+
+	assert(t && t->depth > 0);
+	if (--t->depth == 0) {
+		atomic_store_explicit(&t->state, 0, memory_order_release);
+	}
+}
+
+/* advances the global epoch if every active thread has observed it */
+static unsigned long
+ebr_try_advance(void)
+{
+	unsigned long epoch = atomic_load(&ebr_epoch);
+	struct ebr_thread *t;
+
+	for (t = atomic_load(&ebr_threads); t != NULL; t = t->next) {
+		unsigned long state = atomic_load(&t->state);
+		if ((state & 1) && (state >> 1) != epoch) {
+			return epoch;
+		}
+	}
+	atomic_compare_exchange_strong(&ebr_epoch, &epoch, epoch + 1);
+	return atomic_load(&ebr_epoch);
+}
+
+static void
+ebr_free_list(struct ebr_node *n)
+{
+	while (n != NULL) {
+		struct ebr_node *next = n->next;
+		n->free_fn(n->ptr);
+		n = next;
+	}
+}
+
+void
+ebr_retire(struct ebr_limbo *limbo, struct ebr_node *node, void *ptr,
+	   void (*free_fn)(void *))
+{
+	node->ptr = ptr;
+	node->free_fn = free_fn;
+	/* the object is already unlinked, so the readers that can still see
+	 * it are in this epoch or an earlier one */
+	node->epoch = atomic_load(&ebr_epoch);
+	node->next = limbo->head;
+	limbo->head = node;
+	ebr_reclaim(limbo);
+}
+
+void
+ebr_reclaim(struct ebr_limbo *limbo)
+{
+	unsigned long epoch, next;
+	struct ebr_node **link, *reclaim;
+	int i;
+
+	if (limbo->head == NULL) {
+		return;
+	}
+	/* without readers in the way, two steps are enough for the newest
+	 * object to be freed right away */
+	epoch = atomic_load(&ebr_epoch);
+	for (i = 0; i < 2 && limbo->head->epoch + 2 > epoch; i++) {
+		next = ebr_try_advance();
+		if (next == epoch) {
+			break;
+		}
+		epoch = next;
+	}
+	/* the list is sorted by epoch, newest first, so everything after the
+	 * first object that is old enough is old enough too */
+	for (link = &limbo->head; *link != NULL; link = &(*link)->next) {
+		if ((*link)->epoch + 2 <= epoch) {
+			break;
+		}
+	}
+	reclaim = *link;
+	*link = NULL;
+	ebr_free_list(reclaim);
+}
+
+void
+ebr_flush(struct ebr_limbo *limbo)
+{
+	ebr_free_list(limbo->head);
+	limbo->head = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef __EBR_H__
+#define __EBR_H__
+
+/* epoch-based reclamation: memory that lock-free readers may still be looking
+ * at is retired instead of freed, and is freed once every thread that was
+ * inside a read-side section at the time of retiring has left it. */
+
+/* embedded in every object that may be retired, so retiring allocates
+ * nothing */
+struct ebr_node {
+	void *ptr;
+	void (*free_fn)(void *);
+	unsigned long epoch;	/* global epoch when the object was retired */
+	struct ebr_node *next;
+};
+
+/* retired objects waiting to be freed, newest first. a limbo list belongs to
+ * its caller, which must serialize all calls on it, e.g. with a lock. */
+struct ebr_limbo {
+	struct ebr_node *head;
+};
+
+void ebr_enter(void);
+void ebr_exit(void);
+void ebr_retire(struct ebr_limbo *limbo, struct ebr_node *node, void *ptr,
+		void (*free_fn)(void *));
+/* frees the objects on the list that no reader can see anymore */
+void ebr_reclaim(struct ebr_limbo *limbo);
+/* frees everything on the list. no thread may be inside a read-side section
+ * when this is called. */
+void ebr_flush(struct ebr_limbo *limbo);
+
+#endif /* __EBR_H__ */
@@ -0,0 +1,125 @@
+/*
+ * file_index.c: Checksums and sizes of the files that the server serves.
+ *
+ * The fileset program writes the checksum and size of every file it creates
+ * into an index. With the index, the server knows the checksum of a file
+ * without reading it, so it can send the file straight from the kernel with
+ * sendfile(2). The index has no modification times, but a file that was
+ * modified after the index was written may no longer match it.
+ *
+ * The index is only read after it is loaded, so it needs no locking. It is an
+ * open addressing hash table with linear probing, kept at most half full.
+ */
+
+#include "common.h"
+#include "file_index.h"
+
+struct file_index_entry {
+	char *name;	/* NULL for an empty slot */
+	unsigned int csum;
+	int size;
+};
+
+struct file_index {
+	int size;	/* number of slots, a power of two */
+	struct file_index_entry *entries;
+	struct timespec mtime;	/* of the index file */
+};
+
+/* FNV-1a */
+static unsigned long
+file_index_hash(char *str)
+{
+	unsigned long hash = 14695981039346656037UL;
+
+	while (*str) {
+		hash = (hash ^ (unsigned char)*str++) * 1099511628211UL;
+	}
+	return hash;
+}
+
+static struct file_index_entry *
+file_index_find(struct file_index *idx, char *file_name)
+{
+	unsigned long i = file_index_hash(file_name) & (idx->size - 1);
+
+	while (idx->entries[i].name != NULL &&
+	       strcmp(idx->entries[i].name, file_name)) {
+		i = (i + 1) & (idx->size - 1);
+	}
+	return &idx->entries[i];
+}
+
+struct file_index *
+file_index_load(char *index_file)
+{
+	struct file_index *idx;
+	char buf[MAXLINE], name[MAXLINE + 2];
+	struct stat sbuf;
+	int nr_files, i;
+	FILE *f;
+
+	if ((f = fopen(index_file, "r")) == NULL) {
+		return NULL;
+	}
+	if (fgets(buf, sizeof(buf), f) == NULL ||
+	    sscanf(buf, "%d", &nr_files) != 1 || nr_files < 0) {
+		fclose(f);
+		return NULL;
+	}
+	idx = Malloc(sizeof(struct file_index));
+	SYS(fstat(fileno(f), &sbuf));
+	idx->mtime = sbuf.st_mtim;
+	for (idx->size = 16; idx->size < 2 * nr_files; idx->size *= 2)
+		;
+	idx->entries = Malloc(sizeof(struct file_index_entry) * idx->size);
+	for (i = 0; i < idx->size; i++) {
+		idx->entries[i].name = NULL;
+	}
+	for (i = 0; i < nr_files && fgets(buf, sizeof(buf), f) != NULL; i++) {
+		struct file_index_entry *e;
+		unsigned int csum;
+		int size;
+
+		/* the server prefixes request URIs with ./ */
+		strcpy(name, "./");
+		if (sscanf(buf, "%s %u %d", name + 2, &csum, &size) != 3) {
+			continue;
+		}
+		e = file_index_find(idx, name);
+		if (e->name == NULL) {
+			e->name = strdup(name);
+		}
+		e->csum = csum;
+		e->size = size;
+	}
+	fclose(f);
+	return idx;
+}
+
+int
+file_index_lookup(struct file_index *idx, char *file_name,
+		  unsigned int *csum, int *size, struct timespec *mtime)
+{
+	struct file_index_entry *e = file_index_find(idx, file_name);
+
+	if (e->name == NULL) {
+		return 0;
+	}
+	*csum = e->csum;
+	*size = e->size;
+	*mtime = idx->mtime;
+	return 1;
+}
+
+void
+file_index_destroy(struct file_index *idx)
+{
+	int i;
+
+	for (i = 0; i < idx->size; i++) {
+		free(idx->entries[i].name);
+	}
+	free(idx->entries);
+	free(idx);
+}
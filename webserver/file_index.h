@@ -0,0 +1,19 @@
+#ifndef __FILE_INDEX_H__
+#define __FILE_INDEX_H__
+
+struct file_index;
+
+/* loads an index written by the fileset program, a line with the number of
+ * files followed by one "name csum size" line per file. names are relative
+ * to the directory the server runs in. returns NULL if the index can't be
+ * read. */
+struct file_index *file_index_load(char *index_file);
+/* looks up a file name as formed by the server, e.g. ./fileset_dir/00001.
+ * returns 1 and fills in csum and size if the file is in the index, and mtime
+ * with the time the index was written. a file modified after mtime may no
+ * longer match its csum and size. */
+int file_index_lookup(struct file_index *idx, char *file_name,
+		      unsigned int *csum, int *size, struct timespec *mtime);
+void file_index_destroy(struct file_index *idx);
+
+#endif /* __FILE_INDEX_H__ */
@@ -0,0 +1,323 @@
+/*
+ * http.c: Parser for the request line and the headers of HTTP/1.x requests.
+ *
+ * The parser makes a single pass over the buffer that the request was read
+ * into, and returns slices of it instead of copying the method, the URI and
+ * the headers out. It checks each byte as it goes, so that a malformed request
+ * is rejected as soon as its first bad byte arrives, without waiting for the
+ * rest of it.
+ *
+ * Most of the bytes of a request are in the URI and in the values of the
+ * headers, which end at the first control character. The vector kernel looks
+ * for it 16 bytes at a time: a byte is a control character if it is below a
+ * limit, or DEL, and the smallest of the byte and the limit minus one is the
+ * byte itself if it is below the limit. The kernel is built when the compiler
+ * targets SSE2, which every x86-64 CPU has.
+ *
+ * A request that trickles in is not parsed from the start on every call. The
+ * lines that were complete at the last call were checked already, so only the
+ * line that the new bytes continue, and the lines after it, are checked, and
+ * the request is only parsed from the start once its end may have arrived.
+ * Each line of a request is complete when its CRLF has arrived, so the lines
+ * are told apart by their LF.
+ */
+
+#include "common.h"
+#include "http.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HTTP_SSE2
+#endif
+
+/* the characters of a token, such as a method or a header name */
+static const char http_tchar[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/*  !"#$%&'()*+,-./ */
+	0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+	/* 0123456789:;<=>? */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+	/* @ABCDEFGHIJKLMNO */
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* PQRSTUVWXYZ[\]^_ */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+	/* `abcdefghijklmno */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* pqrstuvwxyz{|}~ DEL */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+};
+
+/* the scans return the first byte from p that is below lo or DEL, or end if
+ * there is none. lo is ' ' to stop at a control character, and '!' to also
+ * stop at a space. */
+static inline char *
+http_scan_scalar(char *p, char *end, int lo)
+{
+	for (; p < end; p++) {
+		unsigned char c = *p;
+
+		if (c < lo || c == 0x7f) {
+			break;
+		}
+	}
+	return p;
+}
+
+#ifdef HTTP_SSE2
+
+static inline char *
+http_scan_sse2(char *p, char *end, int lo)
+{
+	__m128i limit = _mm_set1_epi8(lo - 1);
+	__m128i del = _mm_set1_epi8(0x7f);
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, limit), v);
+		int mask;
+
+		ctl = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, del));
+		if ((mask = _mm_movemask_epi8(ctl)) != 0) {
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return http_scan_scalar(p, end, lo);
+}
+
+#endif /* HTTP_SSE2 */
+
+/* skips the CRLF at p, or returns from the parser */
+#define HTTP_EXPECT_EOL(p, end)						\
+	do {								\
+		if ((p) == (end) || ((p) + 1 == (end) && *(p) == '\r'))	\
+			return HTTP_INCOMPLETE;				\
+		if ((p)[0] != '\r' || (p)[1] != '\n')			\
+			return HTTP_BAD;				\
+		(p) += 2;						\
+	} while (0)
+
+/* parses the header line at *pp into h, and moves *pp past it. returns 0,
+ * HTTP_BAD or HTTP_INCOMPLETE. */
+static inline __attribute__((always_inline)) int
+http_parse_header(char **pp, char *end, struct http_header *h,
+		  char *(*scan)(char *p, char *end, int lo))
+{
+	char *p = *pp, *start;
+
+	/* a line that starts with whitespace continues the last header,
+	 * which is obsolete and rejected */
+	for (start = p; p < end && http_tchar[(unsigned char)*p]; p++)
+		;
+	if (p == end) {
+		return HTTP_INCOMPLETE;
+	}
+	if (p == start || *p != ':') {
+		return HTTP_BAD;
+	}
+	h->name.p = start;
+	h->name.len = p - start;
+	p++;
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	/* the value ends at a control character other than a tab */
+	start = p;
+	while ((p = scan(p, end, ' ')) < end && *p == '\t') {
+		p++;
+	}
+	if (p == end) {
+		return HTTP_INCOMPLETE;
+	}
+	h->value.p = start;
+	h->value.len = p - start;
+	while (h->value.len > 0 && (start[h->value.len - 1] == ' ' ||
+				    start[h->value.len - 1] == '\t')) {
+		h->value.len--;
+	}
+	HTTP_EXPECT_EOL(p, end);
+	*pp = p;
+	return 0;
+}
+
+/* checks the bytes from last_len on, the first last_len bytes being the start
+ * of a request. returns 0 if the whole request has to be parsed, because it
+ * may be complete or the request line hasn't been, or HTTP_BAD or
+ * HTTP_INCOMPLETE. */
+static inline __attribute__((always_inline)) int
+http_check_tail(char *buf, char *end, int last_len,
+		char *(*scan)(char *p, char *end, int lo))
+{
+	struct http_header h;
+	char *p = buf + last_len;
+	int ret;
+
+	/* the start of the line that the new bytes continue */
+	while (p > buf && p[-1] != '\n') {
+		p--;
+	}
+	if (p == buf) {
+		return 0;
+	}
+	while (p < end && *p != '\r') {
+		if ((ret = http_parse_header(&p, end, &h, scan)) != 0) {
+			return ret;
+		}
+	}
+	return p == end ? HTTP_INCOMPLETE : 0;
+}
+
+/* the parser, which each kernel inlines with its scan */
+static inline __attribute__((always_inline)) int
+http_parse(char *buf, int len, int last_len, struct http_request *req,
+	   char *(*scan)(char *p, char *end, int lo))
+{
+	char *p = buf, *end = buf + len, *start;
+	static const char version[] = "HTTP/1.";
+	int i, ret;
+
+	if (last_len > 0 &&
+	    (ret = http_check_tail(buf, end, last_len, scan)) != 0) {
+		return ret;
+	}
+	req->nr_headers = 0;
+
+	/* the method, then a single space */
+	for (start = p; p < end && http_tchar[(unsigned char)*p]; p++)
+		;
+	if (p == end) {
+		return HTTP_INCOMPLETE;
+	}
+	if (p == start || *p != ' ') {
+		return HTTP_BAD;
+	}
+	req->method.p = start;
+	req->method.len = p - start;
+	p++;
+
+	/* the URI, any visible characters */
+	start = p;
+	p = scan(p, end, '!');
+	if (p == end) {
+		return HTTP_INCOMPLETE;
+	}
+	if (p == start || *p != ' ') {
+		return HTTP_BAD;
+	}
+	req->uri.p = start;
+	req->uri.len = p - start;
+	p++;
+
+	/* HTTP/1.x */
+	for (i = 0; i < sizeof(version) - 1; i++, p++) {
+		if (p == end) {
+			return HTTP_INCOMPLETE;
+		}
+		if (*p != version[i]) {
+			return HTTP_BAD;
+		}
+	}
+	if (p == end) {
+		return HTTP_INCOMPLETE;
+	}
+	if (*p < '0' || *p > '9') {
+		return HTTP_BAD;
+	}
+	req->minor_version = *p++ - '0';
+	HTTP_EXPECT_EOL(p, end);
+
+	/* the headers, up to the empty line */
+	while (1) {
+		if (p == end) {
+			return HTTP_INCOMPLETE;
+		}
+		if (*p == '\r') {
+			HTTP_EXPECT_EOL(p, end);
+			return p - buf;
+		}
+		if (req->nr_headers == HTTP_MAX_HEADERS) {
+			return HTTP_BAD;
+		}
+		ret = http_parse_header(&p, end, &req->headers[req->nr_headers],
+					scan);
+		if (ret != 0) {
+			return ret;
+		}
+		req->nr_headers++;
+	}
+}
+
+static int
+http_parse_scalar(char *buf, int len, int last_len, struct http_request *req)
+{
+	return http_parse(buf, len, last_len, req, http_scan_scalar);
+}
+
+#ifdef HTTP_SSE2
+
+static int
+http_parse_sse2(char *buf, int len, int last_len, struct http_request *req)
+{
+	return http_parse(buf, len, last_len, req, http_scan_sse2);
+}
+
+#endif /* HTTP_SSE2 */
+
+static struct http_kernel kernels[] = {
+	{ "scalar", http_parse_scalar },
+#ifdef HTTP_SSE2
+	{ "sse2", http_parse_sse2 },
+#endif
+};
+
+#define NR_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+struct http_kernel *
+http_kernels(int *nr)
+{
+	*nr = NR_KERNELS;
+	return kernels;
+}
+
+int
+http_parse_request(char *buf, int len, int last_len, struct http_request *req)
+{
+#ifdef HTTP_SSE2
+	return http_parse_sse2(buf, len, last_len, req);
+#else
+	return http_parse_scalar(buf, len, last_len, req);
+#endif
+}
+
+int
+http_slice_equals(struct http_slice *s, char *str)
+{
+	return s->len == strlen(str) && strncasecmp(s->p, str, s->len) == 0;
+}
+
+int
+http_has_token(struct http_slice *s, char *token)
+{
+	int len = strlen(token);
+	char *p = s->p, *end = s->p + s->len, *next;
+
+	while (p < end) {
+		/* the elements are separated by commas and whitespace */
+		while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+			p++;
+		}
+		for (next = p; next < end && *next != ','; next++)
+			;
+		/* the element, without trailing whitespace */
+		while (next > p && (next[-1] == ' ' || next[-1] == '\t')) {
+			next--;
+		}
+		if (next - p == len && strncasecmp(p, token, len) == 0) {
+			return 1;
+		}
+		while (p < end && *p != ',') {
+			p++;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+/* a part of the buffer that a request was parsed from, not NUL-terminated */
+struct http_slice {
+	char *p;
+	int len;
+};
+
+struct http_header {
+	struct http_slice name;
+	struct http_slice value;	/* without the surrounding whitespace */
+};
+
+/* a request with more headers is rejected */
+#define HTTP_MAX_HEADERS 64
+
+struct http_request {
+	struct http_slice method;
+	struct http_slice uri;
+	int minor_version;		/* x of HTTP/1.x */
+	struct http_header headers[HTTP_MAX_HEADERS];
+	int nr_headers;
+};
+
+/* results of http_parse_request other than the length of the request */
+enum {
+	HTTP_BAD = -1,		/* the request is malformed */
+	HTTP_INCOMPLETE = -2,	/* the end of the request has yet to arrive */
+};
+
+/* parses the request line and the headers of the request at the start of the
+ * len bytes of buf, up to the empty line. returns the length of the request,
+ * HTTP_INCOMPLETE, or HTTP_BAD as soon as the bytes that have arrived can't
+ * start a request. last_len is the len of the last call on this request if it
+ * returned HTTP_INCOMPLETE, 0 otherwise, so that only the bytes that arrived
+ * since are checked until the end of the request may have arrived. the
+ * slices in req point into buf. */
+int http_parse_request(char *buf, int len, int last_len,
+		       struct http_request *req);
+
+/* s is str, ignoring case */
+int http_slice_equals(struct http_slice *s, char *str);
+/* the comma-separated list in s has the element token, ignoring case, e.g.,
+ * "close" in the value of a Connection header */
+int http_has_token(struct http_slice *s, char *token);
+
+/* the parser scans with the fastest kernel that the CPU supports */
+struct http_kernel {
+	char *name;
+	int (*parse)(char *buf, int len, int last_len,
+		     struct http_request *req);
+};
+
+/* returns the kernels, slowest first. http_parse_request uses the last one. */
+struct http_kernel *http_kernels(int *nr_kernels);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,549 @@
+/*
+ * loader.c: Asynchronous file loader.
+ *
+ * Reads whole files for the threads that ask for them, without blocking those
+ * threads. A load goes through four steps: statx, openat, read (repeated
+ * until the whole file is read), and a delay that simulates a slow disk,
+ * like the one in request.c.
+ *
+ * With io_uring, a single thread drives all the loads. It queues the next
+ * step of every load whose last step completed, submits them all with one
+ * io_uring_enter, and sleeps in the same call until steps complete. The delay
+ * is an io_uring timeout, so no thread sleeps for it, and a single thread
+ * keeps many loads in flight. New loads are handed to the thread through a
+ * list, and an eventfd that the thread keeps a read queued on. The thread is
+ * the only one that touches the rings.
+ *
+ * Without io_uring, if the kernel doesn't have it or doesn't allow it, a pool
+ * of threads goes through the same steps with blocking system calls.
+ */
+
+#include "common.h"
+#include "queue.h"
+#include "loader.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+/* the steps of a load */
+enum {
+	LOAD_STATX,
+	LOAD_OPEN,
+	LOAD_READ,
+	LOAD_DELAY,
+	LOAD_DONE,
+};
+
+#define RING_ENTRIES 256
+#define QUEUE_SIZE 1024
+
+struct loader {
+	int uring;		/* io_uring, or a pool of threads */
+	struct __kernel_timespec delay;
+	int delay_us;
+	/* io_uring, mapped from the kernel */
+	int ring_fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	/* the new loads, handed to the ring thread */
+	pthread_mutex_t lock;
+	struct load *incoming;
+	int stopping;
+	int eventfd;
+	uint64_t event;		/* read from eventfd by the ring */
+	/* the threads */
+	struct queue *queue;	/* the new loads, without io_uring */
+	int nr_threads;
+	pthread_t *threads;
+	/* statistics */
+	atomic_long nr_loads;
+	atomic_int nr_inflight;
+	atomic_int max_inflight;
+};
+
+static int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	       unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+/* counts a load in flight */
+static void
+loader_start(struct loader *l)
+{
+	int n = atomic_fetch_add(&l->nr_inflight, 1) + 1;
+	int max = atomic_load(&l->max_inflight);
+
+	while (n > max &&
+	       !atomic_compare_exchange_weak(&l->max_inflight, &max, n))
+		;
+}
+
+static void
+loader_finish(struct loader *l, struct load *ld)
+{
+	atomic_fetch_sub(&l->nr_inflight, 1);
+	atomic_fetch_add(&l->nr_loads, 1);
+	ld->step = LOAD_DONE;
+	ld->done(ld);
+}
+
+/* the file has been read in */
+static void
+loader_close(struct load *ld)
+{
+	/* ask the kernel to stop caching the file */
+	posix_fadvise(ld->fd, 0, ld->size, POSIX_FADV_DONTNEED);
+	SYS(close(ld->fd));
+	ld->fd = -1;
+}
+
+/* a step failed with error */
+static void
+loader_fail(struct load *ld, int error)
+{
+	ld->error = error;
+	if (ld->fd >= 0) {
+		SYS(close(ld->fd));
+		ld->fd = -1;
+	}
+	free(ld->buf);
+	ld->buf = NULL;
+	ld->step = LOAD_DONE;
+}
+
+/* the file's type and size are known, decides whether to read it */
+static void
+loader_stat_done(struct loader *l, struct load *ld)
+{
+	if (!S_ISREG(ld->mode) || !(S_IRUSR & ld->mode) || ld->size == 0) {
+		/* nothing to read */
+		ld->step = LOAD_DONE;
+		return;
+	}
+	ld->step = LOAD_OPEN;
+}
+
+/* io_uring */
+
+static int
+loader_ring_init(struct loader *l)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	/* the completion ring is twice as large, and there are never more
+	 * steps in flight than submission entries, so it can't overflow */
+	if ((l->ring_fd = io_uring_setup(RING_ENTRIES, &p)) < 0) {
+		return 0;
+	}
+	/* IORING_OP_STATX, OPENAT and READ came with this feature, in 5.6 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		SYS(close(l->ring_fd));
+		return 0;
+	}
+	l->sq_entries = p.sq_entries;
+	l->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	l->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (l->cq_len > l->sq_len) {
+			l->sq_len = l->cq_len;
+		}
+		l->cq_len = 0;
+	}
+	l->sq_ptr = mmap(NULL, l->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, l->ring_fd,
+			 IORING_OFF_SQ_RING);
+	if (l->sq_ptr == MAP_FAILED) {
+		unix_error("mmap");
+	}
+	l->cq_ptr = l->sq_ptr;
+	if (l->cq_len) {
+		l->cq_ptr = mmap(NULL, l->cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, l->ring_fd,
+				 IORING_OFF_CQ_RING);
+		if (l->cq_ptr == MAP_FAILED) {
+			unix_error("mmap");
+		}
+	}
+	l->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	l->sqes = mmap(NULL, l->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, l->ring_fd,
+		       IORING_OFF_SQES);
+	if (l->sqes == MAP_FAILED) {
+		unix_error("mmap");
+	}
+	l->sq_head = l->sq_ptr + p.sq_off.head;
+	l->sq_tail = l->sq_ptr + p.sq_off.tail;
+	l->sq_mask = l->sq_ptr + p.sq_off.ring_mask;
+	l->sq_array = l->sq_ptr + p.sq_off.array;
+	l->cq_head = l->cq_ptr + p.cq_off.head;
+	l->cq_tail = l->cq_ptr + p.cq_off.tail;
+	l->cq_mask = l->cq_ptr + p.cq_off.ring_mask;
+	l->cqes = l->cq_ptr + p.cq_off.cqes;
+	return 1;
+}
+
+/* queues a submission for the next step of ld, or for a read of the eventfd
+ * if ld is NULL. the kernel shares the ring indexes with us, so they are
+ * accessed atomically. */
+static void
+loader_ring_prep(struct loader *l, struct load *ld)
+{
+	unsigned int tail = __atomic_load_n(l->sq_tail, __ATOMIC_RELAXED);
+	unsigned int i = tail & *l->sq_mask;
+	struct io_uring_sqe *sqe = &l->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (unsigned long)ld;
+	if (ld == NULL) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = l->eventfd;
+		sqe->addr = (unsigned long)&l->event;
+		sqe->len = sizeof(l->event);
+	} else if (ld->step == LOAD_STATX) {
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)ld->file_name;
+		sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+		sqe->off = (unsigned long)&ld->stx;
+	} else if (ld->step == LOAD_OPEN) {
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)ld->file_name;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	} else if (ld->step == LOAD_READ) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = ld->fd;
+		sqe->addr = (unsigned long)(ld->buf + ld->done_size);
+		sqe->len = ld->size - ld->done_size;
+		sqe->off = ld->done_size;
+	} else {
+		assert(ld->step == LOAD_DELAY);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (unsigned long)&l->delay;
+		sqe->len = 1;
+	}
+	l->sq_array[i] = i;
+	/* the kernel sees the entry once it sees the new tail */
+	__atomic_store_n(l->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* moves ld on to its next step, once its last step completed with res */
+static void
+loader_ring_step(struct loader *l, struct load *ld, int res)
+{
+	switch (ld->step) {
+	case LOAD_STATX:
+		if (res < 0) {
+			loader_fail(ld, -res);
+			return;
+		}
+		ld->mode = ld->stx.stx_mode;
+		ld->size = ld->stx.stx_size;
+		ld->mtime.tv_sec = ld->stx.stx_mtime.tv_sec;
+		ld->mtime.tv_nsec = ld->stx.stx_mtime.tv_nsec;
+		loader_stat_done(l, ld);
+		return;
+	case LOAD_OPEN:
+		if (res < 0) {
+			loader_fail(ld, -res);
+			return;
+		}
+		ld->fd = res;
+		ld->buf = Malloc(ld->size);
+		ld->done_size = 0;
+		ld->step = LOAD_READ;
+		return;
+	case LOAD_READ:
+		if (res < 0) {
+			if (res != -EINTR && res != -EAGAIN) {
+				loader_fail(ld, -res);
+			}
+			return;
+		}
+		ld->done_size += res;
+		if (res == 0) {
+			/* the file shrunk since statx */
+			ld->size = ld->done_size;
+		}
+		if (ld->done_size < ld->size) {
+			return;
+		}
+		loader_close(ld);
+		ld->step = l->delay_us > 0 ? LOAD_DELAY : LOAD_DONE;
+		return;
+	default:
+		/* the delay completes with -ETIME */
+		ld->step = LOAD_DONE;
+	}
+}
+
+static void *
+loader_ring_thread(void *arg)
+{
+	struct loader *l = arg;
+	struct load *ready = NULL, **ready_tail = &ready, *ld, *in, *prev;
+	struct io_uring_cqe *cqe;
+	unsigned int head, to_submit = 0, nr_steps = 0;
+	int event_queued = 0, stopping, n;
+
+	while (1) {
+		/* take the new loads, and add them to the ones that are ready
+		 * for their next step */
+		pthread_mutex_lock(&l->lock);
+		in = l->incoming;
+		l->incoming = NULL;
+		stopping = l->stopping;
+		pthread_mutex_unlock(&l->lock);
+		/* the newest load is first, put them in the order they came */
+		for (prev = NULL; in; in = ld) {
+			ld = in->next;
+			in->next = prev;
+			prev = in;
+		}
+		in = prev;
+		while (in) {
+			ld = in;
+			in = in->next;
+			ld->next = NULL;
+			*ready_tail = ld;
+			ready_tail = &ld->next;
+		}
+		if (!event_queued) {
+			loader_ring_prep(l, NULL);
+			event_queued = 1;
+			to_submit++;
+		}
+		/* the eventfd read takes a submission entry of its own */
+		while (ready && nr_steps < l->sq_entries - 1) {
+			ld = ready;
+			ready = ld->next;
+			if (ready == NULL) {
+				ready_tail = &ready;
+			}
+			loader_ring_prep(l, ld);
+			nr_steps++;
+			to_submit++;
+		}
+		if (stopping && nr_steps == 0 && ready == NULL) {
+			break;
+		}
+		n = io_uring_enter(l->ring_fd, to_submit, 1,
+				   IORING_ENTER_GETEVENTS);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EBUSY) {
+				continue;
+			}
+			unix_error("io_uring_enter");
+		}
+		to_submit -= n;
+
+		head = __atomic_load_n(l->cq_head, __ATOMIC_RELAXED);
+		while (head != __atomic_load_n(l->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &l->cqes[head & *l->cq_mask];
+			ld = (struct load *)(unsigned long)cqe->user_data;
+			if (ld == NULL) {
+				/* new loads were handed to us */
+				event_queued = 0;
+			} else {
+				nr_steps--;
+				loader_ring_step(l, ld, cqe->res);
+				if (ld->step == LOAD_DONE) {
+					loader_finish(l, ld);
+				} else {
+					ld->next = NULL;
+					*ready_tail = ld;
+					ready_tail = &ld->next;
+				}
+			}
+			head++;
+			__atomic_store_n(l->cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+/* threads */
+
+static void *
+loader_thread(void *arg)
+{
+	struct loader *l = arg;
+	struct load *ld;
+	struct stat sbuf;
+	ssize_t n;
+
+	while ((ld = queue_pop(l->queue)) != NULL) {
+		if (stat(ld->file_name, &sbuf) < 0) {
+			loader_fail(ld, errno);
+			loader_finish(l, ld);
+			continue;
+		}
+		ld->mode = sbuf.st_mode;
+		ld->size = sbuf.st_size;
+		ld->mtime = sbuf.st_mtim;
+		loader_stat_done(l, ld);
+		if (ld->step == LOAD_DONE) {
+			loader_finish(l, ld);
+			continue;
+		}
+		if ((ld->fd = open(ld->file_name, O_RDONLY | O_CLOEXEC)) < 0) {
+			loader_fail(ld, errno);
+			loader_finish(l, ld);
+			continue;
+		}
+		ld->buf = Malloc(ld->size);
+		ld->done_size = 0;
+		n = 0;
+		while (ld->done_size < ld->size) {
+			n = read(ld->fd, ld->buf + ld->done_size,
+				 ld->size - ld->done_size);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				break;
+			}
+			ld->done_size += n;
+		}
+		if (n < 0) {
+			/* e.g., EIO, the request gets an error response */
+			loader_fail(ld, errno);
+			loader_finish(l, ld);
+			continue;
+		}
+		/* the file shrunk since stat if it ended early */
+		ld->size = ld->done_size;
+		loader_close(ld);
+		/* we do this to simulate a slow disk, see request.c */
+		if (l->delay_us > 0) {
+			usleep(l->delay_us);
+		}
+		loader_finish(l, ld);
+	}
+	return NULL;
+}
+
+struct loader *
+loader_init(int uring, int nr_threads, int delay_us)
+{
+	struct loader *l = Malloc(sizeof(struct loader));
+	int i;
+
+	l->delay_us = delay_us;
+	l->delay.tv_sec = delay_us / 1000000;
+	l->delay.tv_nsec = (delay_us % 1000000) * 1000L;
+	atomic_init(&l->nr_loads, 0);
+	atomic_init(&l->nr_inflight, 0);
+	atomic_init(&l->max_inflight, 0);
+	l->uring = uring && loader_ring_init(l);
+	if (l->uring) {
+		pthread_mutex_init(&l->lock, NULL);
+		l->incoming = NULL;
+		l->stopping = 0;
+		SYS(l->eventfd = eventfd(0, EFD_CLOEXEC));
+		l->nr_threads = 1;
+		l->threads = Malloc(sizeof(pthread_t));
+		pthread_create(&l->threads[0], NULL, loader_ring_thread, l);
+		return l;
+	}
+	assert(nr_threads > 0);
+	l->queue = queue_init(QUEUE_SIZE);
+	l->nr_threads = nr_threads;
+	l->threads = Malloc(sizeof(pthread_t) * nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_create(&l->threads[i], NULL, loader_thread, l);
+	}
+	return l;
+}
+
+void
+loader_submit(struct loader *l, struct load *ld)
+{
+	uint64_t one = 1;
+	int wake;
+
+	ld->error = 0;
+	ld->mode = 0;
+	ld->buf = NULL;
+	ld->size = 0;
+	ld->step = LOAD_STATX;
+	ld->fd = -1;
+	ld->next = NULL;
+	loader_start(l);
+	if (!l->uring) {
+		queue_push(l->queue, ld);
+		return;
+	}
+	pthread_mutex_lock(&l->lock);
+	/* the ring thread takes all the new loads at once, so it only needs
+	 * to be woken up for the first one */
+	wake = l->incoming == NULL;
+	ld->next = l->incoming;
+	l->incoming = ld;
+	pthread_mutex_unlock(&l->lock);
+	if (wake) {
+		SYS(write(l->eventfd, &one, sizeof(one)));
+	}
+}
+
+char *
+loader_kind(struct loader *l)
+{
+	return l->uring ? "io_uring" : "threads";
+}
+
+void
+loader_print_stats(struct loader *l)
+{
+	printf("loader: %s, loads = %ld, max in flight = %d\n", loader_kind(l),
+	       atomic_load(&l->nr_loads), atomic_load(&l->max_inflight));
+}
+
+void
+loader_destroy(struct loader *l)
+{
+	uint64_t one = 1;
+	int i;
+
+	if (l->uring) {
+		pthread_mutex_lock(&l->lock);
+		l->stopping = 1;
+		pthread_mutex_unlock(&l->lock);
+		SYS(write(l->eventfd, &one, sizeof(one)));
+	} else {
+		queue_close(l->queue);
+	}
+	for (i = 0; i < l->nr_threads; i++) {
+		assert(!pthread_join(l->threads[i], NULL));
+	}
+	if (l->uring) {
+		/* closing the ring cancels the eventfd read */
+		munmap(l->sqes, l->sqes_len);
+		if (l->cq_len) {
+			munmap(l->cq_ptr, l->cq_len);
+		}
+		munmap(l->sq_ptr, l->sq_len);
+		SYS(close(l->ring_fd));
+		SYS(close(l->eventfd));
+		pthread_mutex_destroy(&l->lock);
+	} else {
+		queue_destroy(l->queue);
+	}
+	free(l->threads);
+	free(l);
+}
@@ -0,0 +1,41 @@
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+/* reads whole files asynchronously, with io_uring or a pool of threads */
+struct loader;
+
+/* a file to load */
+struct load {
+	/* set by the caller */
+	char *file_name;
+	/* called once the file has been loaded, or the load failed, from a
+	 * thread of the loader */
+	void (*done)(struct load *ld);
+	/* set by the loader before done is called */
+	int error;	/* the errno of the step that failed, or 0 */
+	mode_t mode;	/* the file is only read if it is a readable regular
+			 * file, check mode when buf is NULL */
+	char *buf;	/* the contents of the file, owned by the caller */
+	int size;
+	struct timespec mtime;
+	/* private to the loader */
+	int step;
+	int fd;
+	int done_size;
+	struct statx stx;
+	struct load *next;
+};
+
+/* uring is set to try io_uring first. delay_us is added to every load of a
+ * file that isn't empty, to simulate a slow disk. */
+struct loader *loader_init(int uring, int nr_threads, int delay_us);
+/* starts loading ld->file_name, and returns at once */
+void loader_submit(struct loader *l, struct load *ld);
+/* "io_uring" or "threads" */
+char *loader_kind(struct loader *l);
+/* prints the number of loads and the most that were in flight on stdout */
+void loader_print_stats(struct loader *l);
+/* waits for the loads in flight to be done */
+void loader_destroy(struct loader *l);
+
+#endif /* __LOADER_H__ */
@@ -0,0 +1,312 @@
+/*
+ * parse_bench.c: Microbenchmark for the HTTP request parser.
+ *
+ * To run:
+ *  parse_bench [seconds]
+ *
+ * Measures how long every kernel of the parser in http.c takes to parse a
+ * few typical requests, from the two-line requests that the client sends to
+ * the requests of a browser with a dozen headers and cookies, and compares
+ * them with the parser that the server used before: strstr for the end of
+ * the request, sscanf for the request line, and strstr again for each
+ * header line.
+ *
+ * Also checks that all kernels agree on each request, that every prefix of
+ * a request is incomplete, and that malformed requests are rejected, if
+ * possible before they are complete, wherever the reads that they arrive in
+ * are split.
+ */
+
+#include "common.h"
+#include "http.h"
+
+#define DEFAULT_SECONDS 0.5
+
+struct bench_request {
+	char *name;
+	char *text;
+};
+
+static struct bench_request requests[] = {
+	{ "client",
+	  "GET /fileset_dir/00042.html HTTP/1.1\r\n"
+	  "host: localhost\r\n"
+	  "\r\n" },
+	{ "curl",
+	  "GET /fileset_dir/00042.html HTTP/1.1\r\n"
+	  "Host: www.example.com\r\n"
+	  "User-Agent: curl/8.5.0\r\n"
+	  "Accept: */*\r\n"
+	  "\r\n" },
+	{ "browser",
+	  "GET /wp-content/uploads/2010/03/hello-kitty-darth-vader-pink.jpg "
+	  "HTTP/1.1\r\n"
+	  "Host: www.kittyhell.com\r\n"
+	  "User-Agent: Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_3; "
+	  "ja-JP-mac) AppleWebKit/533.16 (KHTML, like Gecko) Version/5.0 "
+	  "Safari/533.16\r\n"
+	  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	  "*/*;q=0.8\r\n"
+	  "Accept-Language: ja-jp\r\n"
+	  "Accept-Encoding: gzip, deflate\r\n"
+	  "Connection: keep-alive\r\n"
+	  "Cache-Control: max-age=0\r\n"
+	  "Upgrade-Insecure-Requests: 1\r\n"
+	  "Referer: http://www.kittyhell.com/\r\n"
+	  "If-Modified-Since: Sat, 20 Mar 2010 14:20:50 GMT\r\n"
+	  "Cookie: wp_ozh_wsa_visits=2; wp_ozh_wsa_visit_lasttime=xxxxxxxxxx; "
+	  "__utma=xxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.x; "
+	  "__utmz=xxxxxxxxx.xxxxxxxxxx.x.x.utmccn=(referral)|utmcsr=reader."
+	  "livedoor.com|utmcct=/reader/|utmcmd=referral\r\n"
+	  "\r\n" },
+};
+
+#define NR_REQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+/* each is rejected once the bytes up to the bad one have arrived */
+static char *bad_requests[] = {
+	"G\001T / HTTP/1.1\r\n",
+	" GET / HTTP/1.1\r\n",
+	"GET  / HTTP/1.1\r\n",
+	"GET /a\001b HTTP/1.1\r\n",
+	"GET / HTTP/2.0\r\n",
+	"GET / HTTP/1.x\r\n",
+	"GET / HTTP/1.1\n",
+	"GET / HTTP/1.1\r\nHost localhost\r\n",
+	"GET / HTTP/1.1\r\nHost: a\r\n folded\r\n",
+	"GET / HTTP/1.1\r\n: empty\r\n",
+	"GET / HTTP/1.1\r\nHost: a\001b\r\n",
+	"GET / HTTP/1.1\r\nHost: a\r\r\n",
+	"GET / HTTP/1.1\r\nHost: a\r\nAccept: */*\r\nX\001: b\r\n",
+	"GET / HTTP/1.1\r\nHost: a\r\nAccept: */*\r\n\r\r\n",
+};
+
+#define NR_BAD_REQUESTS (sizeof(bad_requests) / sizeof(bad_requests[0]))
+
+/* the parser that the server used before, for comparison */
+static int
+legacy_parse(char *buf, int *keepalive)
+{
+	char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	char *end, *line, next;
+	int req_len;
+
+	if ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+		return HTTP_INCOMPLETE;
+	}
+	req_len = end + 4 - buf;
+	next = buf[req_len];
+	buf[req_len] = 0;
+	method[0] = uri[0] = version[0] = 0;
+	sscanf(buf, "%s %s %s", method, uri, version);
+	*keepalive = strcasecmp(version, "HTTP/1.1") == 0;
+	line = strstr(buf, "\r\n");
+	while (line && line[2] != '\r') {
+		line += 2;
+		if (strncasecmp(line, "Connection:", 11) == 0) {
+			char *end = strstr(line, "\r\n");
+
+			*end = 0;
+			if (strcasestr(line, "close")) {
+				*keepalive = 0;
+			} else if (strcasestr(line, "keep-alive")) {
+				*keepalive = 1;
+			}
+			*end = '\r';
+		}
+		line = strstr(line, "\r\n");
+	}
+	buf[req_len] = next;
+	return strcasecmp(method, "GET") == 0 ? req_len : HTTP_BAD;
+}
+
+/* like the server, finds the Connection header in a parsed request */
+static int
+bench_keepalive(struct http_request *req)
+{
+	int i, keepalive = req->minor_version >= 1;
+
+	for (i = 0; i < req->nr_headers; i++) {
+		struct http_header *h = &req->headers[i];
+
+		if (!http_slice_equals(&h->name, "Connection")) {
+			continue;
+		}
+		if (http_has_token(&h->value, "close")) {
+			keepalive = 0;
+		} else if (http_has_token(&h->value, "keep-alive")) {
+			keepalive = 1;
+		}
+	}
+	return keepalive;
+}
+
+static double
+elapsed_s(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+		(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* parses buf repeatedly for about seconds with kernel k, or with the legacy
+ * parser if k is NULL. returns ns per request. */
+static double
+bench_parser(struct http_kernel *k, char *buf, int len, double seconds)
+{
+	struct timespec start, end;
+	struct http_request req;
+	volatile int sink;
+	long nr = 0;
+	int i, keepalive;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (i = 0; i < 100000; i++) {
+			if (k) {
+				sink = k->parse(buf, len, 0, &req);
+				sink = bench_keepalive(&req);
+			} else {
+				sink = legacy_parse(buf, &keepalive);
+				sink = keepalive;
+			}
+		}
+		nr += i;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+	} while (elapsed_s(&start, &end) < seconds);
+	(void)sink;
+	return elapsed_s(&start, &end) * 1e9 / nr;
+}
+
+/* checks the kernels against each other and against the legacy parser */
+static void
+check_kernels(struct http_kernel *kernels, int nr_kernels)
+{
+	struct http_request req, req0;
+	int i, k, len, prefix, ret, keepalive;
+	char *text;
+
+	for (i = 0; i < NR_REQUESTS; i++) {
+		text = requests[i].text;
+		len = strlen(text);
+		for (k = 0; k < nr_kernels; k++) {
+			ret = kernels[k].parse(text, len, 0,
+					       k == 0 ? &req0 : &req);
+			if (ret != len || (k > 0 &&
+			    (req.nr_headers != req0.nr_headers ||
+			     req.uri.len != req0.uri.len ||
+			     req.headers[req.nr_headers - 1].value.len !=
+			     req0.headers[req.nr_headers - 1].value.len))) {
+				fprintf(stderr, "%s: wrong parse of %s\n",
+					kernels[k].name, requests[i].name);
+				exit(1);
+			}
+			if (kernels[k].parse(text, len, len - 1, &req) != len) {
+				fprintf(stderr, "%s: %s not complete\n",
+					kernels[k].name, requests[i].name);
+				exit(1);
+			}
+			/* the request arrives a byte at a time */
+			for (prefix = 0; prefix < len; prefix++) {
+				ret = kernels[k].parse(text, prefix,
+						       prefix - 1, &req);
+				if (ret != HTTP_INCOMPLETE ||
+				    kernels[k].parse(text, prefix, 0, &req) !=
+				    HTTP_INCOMPLETE) {
+					fprintf(stderr, "%s: %d bytes of %s "
+						"not incomplete\n",
+						kernels[k].name, prefix,
+						requests[i].name);
+					exit(1);
+				}
+			}
+		}
+		/* the legacy parser writes to the request */
+		text = strdup(text);
+		if (legacy_parse(text, &keepalive) != len ||
+		    keepalive != bench_keepalive(&req0)) {
+			fprintf(stderr, "legacy: different parse of %s\n",
+				requests[i].name);
+			exit(1);
+		}
+		free(text);
+	}
+	for (i = 0; i < NR_BAD_REQUESTS; i++) {
+		text = bad_requests[i];
+		len = strlen(text);
+		for (k = 0; k < nr_kernels; k++) {
+			ret = kernels[k].parse(text, len, 0, &req);
+			if (ret != HTTP_BAD) {
+				fprintf(stderr, "%s: bad request %d not "
+					"rejected\n", kernels[k].name, i);
+				exit(1);
+			}
+			/* the bad byte arrives in a later read than the
+			 * first prefix bytes, or a byte at a time */
+			for (prefix = 1; prefix < len; prefix++) {
+				ret = kernels[k].parse(text, prefix, 0, &req);
+				if (ret == HTTP_INCOMPLETE) {
+					ret = kernels[k].parse(text, len,
+							       prefix, &req);
+				}
+				if (ret != HTTP_BAD) {
+					fprintf(stderr, "%s: bad request %d "
+						"not rejected after %d bytes\n",
+						kernels[k].name, i, prefix);
+					exit(1);
+				}
+			}
+			for (prefix = 1, ret = HTTP_INCOMPLETE;
+			     prefix <= len && ret == HTTP_INCOMPLETE;
+			     prefix++) {
+				ret = kernels[k].parse(text, prefix,
+						       prefix - 1, &req);
+			}
+			if (ret != HTTP_BAD) {
+				fprintf(stderr, "%s: bad request %d not "
+					"rejected a byte at a time\n",
+					kernels[k].name, i);
+				exit(1);
+			}
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	double seconds = DEFAULT_SECONDS;
+	struct http_kernel *kernels;
+	int nr_kernels, i, k, len;
+	char *buf;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [seconds]\n", argv[0]);
+		exit(1);
+	}
+	if (argc == 2) {
+		seconds = atof(argv[1]);
+	}
+	if (seconds <= 0) {
+		fprintf(stderr, "seconds should be > 0\n");
+		exit(1);
+	}
+
+	kernels = http_kernels(&nr_kernels);
+	check_kernels(kernels, nr_kernels);
+
+	printf("# parser, request, bytes, ns/request, MB/s\n");
+	for (i = 0; i < NR_REQUESTS; i++) {
+		buf = strdup(requests[i].text);
+		len = strlen(buf);
+		for (k = -1; k < nr_kernels; k++) {
+			double ns = bench_parser(k < 0 ? NULL : &kernels[k],
+						 buf, len, seconds);
+
+			printf("%s, %s, %d, %.1f, %.0f\n",
+			       k < 0 ? "legacy" : kernels[k].name,
+			       requests[i].name, len, ns, len * 1e3 / ns);
+		}
+		free(buf);
+	}
+	exit(0);
+}
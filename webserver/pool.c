@@ -0,0 +1,262 @@
+/*
+ * pool.c: Pools of objects of a fixed size.
+ *
+ * The objects that each request or connection needs are allocated from pools
+ * instead of with malloc. A pool carves its objects out of large slabs that it
+ * never returns to the heap until it is destroyed, so that the heap doesn't
+ * grow fragmented as connections come and go, and the same few objects are
+ * used again and again while they are still in the CPU's caches.
+ *
+ * Each thread keeps a cache of free objects for each pool, so that allocating
+ * and freeing an object usually takes no lock. A thread whose cache is empty
+ * takes a batch of objects from the pool's shared free list, and gives a batch
+ * back when its cache grows too large, so that objects allocated by one
+ * thread and freed by another, as the stages of the server do, move back to
+ * where they are needed. A thread that exits gives its caches back.
+ *
+ * Free objects are linked through their first word.
+ */
+
+#include "common.h"
+#include "pool.h"
+
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_MIN_PER_SLAB 8
+#define POOL_MAX_BATCH 32
+
+struct pool {
+	char *name;
+	int id;			/* index in pools */
+	unsigned int gen;	/* tells this pool from an earlier one at id */
+	size_t size;		/* of an object */
+	int nr_per_slab;
+	int batch;		/* objects moved to or from a thread at once */
+	pthread_mutex_t lock;
+	void *free;		/* shared free list */
+	int nr_free;
+	void *slabs;		/* linked through their first word */
+	int nr_slabs;
+	long nr_refills;	/* batches taken by threads */
+};
+
+/* a thread's free objects of a pool */
+struct pool_cache {
+	unsigned int gen;	/* of the pool they belong to, 0 if none */
+	void *free;
+	int nr_free;
+};
+
+static struct pool *pools[POOL_MAX];
+static unsigned int pool_gen;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+/* its destructor gives a thread's caches back when the thread exits */
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static __thread struct pool_cache pool_caches[POOL_MAX];
+static __thread int pool_thread_registered;
+
+/* moves nr objects from the head of the list at *list to the pool's shared
+ * free list. called with the pool's lock held. */
+static void
+pool_put_batch(struct pool *p, void **list, int nr)
+{
+	void *obj;
+
+	while (nr-- > 0 && (obj = *list) != NULL) {
+		*list = *(void **)obj;
+		*(void **)obj = p->free;
+		p->free = obj;
+		p->nr_free++;
+	}
+}
+
+/* gives all of a thread's objects back to their pools */
+static void
+pool_thread_exit(void *arg)
+{
+	struct pool_cache *caches = arg;
+	struct pool *p;
+	int id;
+
+	pthread_mutex_lock(&pools_lock);
+	for (id = 0; id < POOL_MAX; id++) {
+		p = pools[id];
+		if (p == NULL || caches[id].gen != p->gen) {
+			continue;
+		}
+		pthread_mutex_lock(&p->lock);
+		pool_put_batch(p, &caches[id].free, caches[id].nr_free);
+		pthread_mutex_unlock(&p->lock);
+		caches[id].gen = 0;
+		caches[id].nr_free = 0;
+	}
+	pthread_mutex_unlock(&pools_lock);
+	/* another destructor may still free objects, the caches are given
+	 * back again after it */
+	pool_thread_registered = 0;
+}
+
+static void
+pool_key_init(void)
+{
+	assert(!pthread_key_create(&pool_key, pool_thread_exit));
+}
+
+/* returns the calling thread's cache of p */
+static struct pool_cache *
+pool_cache_get(struct pool *p)
+{
+	struct pool_cache *c = &pool_caches[p->id];
+
+	if (c->gen != p->gen) {
+		/* the objects left from an earlier pool at this id were
+		 * freed with it */
+		if (!pool_thread_registered) {
+			pthread_once(&pool_once, pool_key_init);
+			pthread_setspecific(pool_key, pool_caches);
+			pool_thread_registered = 1;
+		}
+		c->gen = p->gen;
+		c->free = NULL;
+		c->nr_free = 0;
+	}
+	return c;
+}
+
+/* adds a slab to the shared free list. called with the pool's lock held. */
+static void
+pool_grow(struct pool *p)
+{
+	char *slab = Malloc(16 + p->size * p->nr_per_slab);
+	char *obj;
+	int i;
+
+	*(void **)slab = p->slabs;
+	p->slabs = slab;
+	p->nr_slabs++;
+	/* the slab's objects are handed out in order */
+	for (i = p->nr_per_slab - 1; i >= 0; i--) {
+		obj = slab + 16 + i * p->size;
+		*(void **)obj = p->free;
+		p->free = obj;
+	}
+	p->nr_free += p->nr_per_slab;
+}
+
+struct pool *
+pool_init(char *name, size_t size)
+{
+	struct pool *p = Malloc(sizeof(struct pool));
+	int id;
+
+	/* objects are aligned like malloc's */
+	size = (size < sizeof(void *) ? sizeof(void *) : size);
+	size = (size + 15) & ~(size_t)15;
+	p->name = name;
+	p->size = size;
+	p->nr_per_slab = POOL_SLAB_SIZE / size;
+	if (p->nr_per_slab < POOL_MIN_PER_SLAB) {
+		p->nr_per_slab = POOL_MIN_PER_SLAB;
+	}
+	p->batch = p->nr_per_slab / 2;
+	if (p->batch > POOL_MAX_BATCH) {
+		p->batch = POOL_MAX_BATCH;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	p->free = NULL;
+	p->nr_free = 0;
+	p->slabs = NULL;
+	p->nr_slabs = 0;
+	p->nr_refills = 0;
+	pthread_mutex_lock(&pools_lock);
+	for (id = 0; id < POOL_MAX && pools[id] != NULL; id++)
+		;
+	assert(id < POOL_MAX);
+	p->id = id;
+	/* 0 is for caches that belong to no pool */
+	if (++pool_gen == 0) {
+		pool_gen = 1;
+	}
+	p->gen = pool_gen;
+	pools[id] = p;
+	pthread_mutex_unlock(&pools_lock);
+	return p;
+}
+
+void *
+pool_alloc(struct pool *p)
+{
+	struct pool_cache *c = pool_cache_get(p);
+	void *obj;
+	int i;
+
+	if (c->free == NULL) {
+		pthread_mutex_lock(&p->lock);
+		if (p->nr_free < p->batch) {
+			pool_grow(p);
+		}
+		/* the whole batch is cut off the shared list at once */
+		obj = p->free;
+		for (i = 1; i < p->batch; i++) {
+			obj = *(void **)obj;
+		}
+		c->free = p->free;
+		c->nr_free = p->batch;
+		p->free = *(void **)obj;
+		*(void **)obj = NULL;
+		p->nr_free -= p->batch;
+		p->nr_refills++;
+		pthread_mutex_unlock(&p->lock);
+	}
+	obj = c->free;
+	c->free = *(void **)obj;
+	c->nr_free--;
+	return obj;
+}
+
+void
+pool_free(struct pool *p, void *obj)
+{
+	struct pool_cache *c = pool_cache_get(p);
+
+	if (obj == NULL) {
+		return;
+	}
+	*(void **)obj = c->free;
+	c->free = obj;
+	if (++c->nr_free >= 2 * p->batch) {
+		pthread_mutex_lock(&p->lock);
+		pool_put_batch(p, &c->free, p->batch);
+		pthread_mutex_unlock(&p->lock);
+		c->nr_free -= p->batch;
+	}
+}
+
+void
+pool_print_stats(struct pool *p)
+{
+	pthread_mutex_lock(&p->lock);
+	printf("pool %s: %d slabs, %d objects of %zu bytes, %ld refills\n",
+	       p->name, p->nr_slabs, p->nr_slabs * p->nr_per_slab, p->size,
+	       p->nr_refills);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+pool_destroy(struct pool *p)
+{
+	void *slab;
+
+	pthread_mutex_lock(&pools_lock);
+	pools[p->id] = NULL;
+	pthread_mutex_unlock(&pools_lock);
+	/* a thread that still caches objects of p drops them when it next
+	 * uses a pool at this id, since the generation differs */
+	while ((slab = p->slabs) != NULL) {
+		p->slabs = *(void **)slab;
+		free(slab);
+	}
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
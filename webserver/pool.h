@@ -0,0 +1,20 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+/* a pool of objects of one size, see pool.c */
+struct pool;
+
+/* at most POOL_MAX pools exist at once */
+#define POOL_MAX 16
+
+struct pool *pool_init(char *name, size_t size);
+/* objects may be freed by any thread, not only the one that allocated them */
+void *pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *obj);
+/* prints the number of slabs and objects on stdout */
+void pool_print_stats(struct pool *p);
+/* frees the slabs, and so every object of the pool. the other threads that
+ * used the pool must have exited. */
+void pool_destroy(struct pool *p);
+
+#endif /* __POOL_H__ */
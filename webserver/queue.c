@@ -0,0 +1,361 @@
+/*
+ * queue.c: Bounded lock-free MPMC queue, after Dmitry Vyukov's.
+ *
+ * Each slot has a sequence number that says whose turn it is. A producer
+ * claims the slot at the tail position pos when its sequence is 2 * pos, and
+ * publishes the item by setting it to 2 * pos + 1. A consumer claims the slot
+ * at the head position pos when its sequence is 2 * pos + 1, and frees the
+ * slot for the next lap by setting it to 2 * (pos + size). Unlike Vyukov's
+ * pos, pos + 1 and pos + size, a full slot can't be mistaken for a free one
+ * when the queue has a single slot. Producers and consumers race for
+ * positions with a compare-and-swap on tail and head only, so they never wait
+ * for each other unless the queue is empty or full.
+ *
+ * A thread that finds the queue empty (or full) parks on a futex. It counts
+ * itself as a waiter, checks the queue once more, and sleeps only if the
+ * futex word hasn't changed since it first looked. A thread that makes
+ * progress for the other side bumps the futex word and wakes a single waiter,
+ * and only when there is one and no other wakeup is pending. So a handoff
+ * costs no system call while the consumers are busy, one item never wakes
+ * every idle thread, and a burst of items makes a single system call. The
+ * woken thread passes the wakeup on if more items are waiting.
+ */
+
+#include "common.h"
+#include "queue.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define CACHE_LINE 64
+
+struct queue_slot {
+	_Atomic unsigned long seq;
+	void *item;
+};
+
+/* the threads waiting for one side of the queue */
+struct queue_waiters {
+	atomic_uint futex;	/* bumped on every wakeup */
+	atomic_int nr_waiting;
+	/* a wakeup is on its way, the woken thread clears this */
+	atomic_int pending;
+};
+
+struct queue {
+	int size;
+	struct queue_slot *slots;
+	/* the positions are written by different threads, keep them on
+	 * different cache lines */
+	_Alignas(CACHE_LINE) _Atomic unsigned long head;
+	_Alignas(CACHE_LINE) _Atomic unsigned long tail;
+	_Alignas(CACHE_LINE) struct queue_waiters not_empty;
+	struct queue_waiters not_full;
+	atomic_int closed;
+};
+
+/* timeout is relative, NULL to wait for as long as it takes */
+static void
+futex_wait(atomic_uint *addr, unsigned int val, struct timespec *timeout)
+{
+	/* returns at once if *addr is no longer val */
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void
+futex_wake(atomic_uint *addr, int nr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+struct queue *
+queue_init(int size)
+{
+	struct queue *q;
+	int i;
+
+	assert(size > 0);
+	/* Malloc doesn't align the struct to a cache line */
+	if ((errno = posix_memalign((void **)&q, CACHE_LINE,
+				    sizeof(struct queue))) != 0) {
+		unix_error("posix_memalign");
+	}
+	q->size = size;
+	q->slots = Malloc(sizeof(struct queue_slot) * size);
+	for (i = 0; i < size; i++) {
+		atomic_init(&q->slots[i].seq, 2 * i);
+	}
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->not_empty.futex, 0);
+	atomic_init(&q->not_empty.nr_waiting, 0);
+	atomic_init(&q->not_empty.pending, 0);
+	atomic_init(&q->not_full.futex, 0);
+	atomic_init(&q->not_full.nr_waiting, 0);
+	atomic_init(&q->not_full.pending, 0);
+	atomic_init(&q->closed, 0);
+	return q;
+}
+
+/* adds item at the tail, if there is room */
+static int
+queue_put(struct queue *q, void *item)
+{
+	unsigned long pos = atomic_load_explicit(&q->tail,
+						 memory_order_relaxed);
+	struct queue_slot *slot;
+	long diff;
+
+	while (1) {
+		slot = &q->slots[pos % q->size];
+		diff = (long)(atomic_load_explicit(&slot->seq,
+						   memory_order_acquire) -
+			      2 * pos);
+		if (diff == 0) {
+			/* the slot is free, claim it. on failure, pos is
+			 * reloaded */
+			if (atomic_compare_exchange_weak_explicit(
+				    &q->tail, &pos, pos + 1,
+				    memory_order_relaxed,
+				    memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* the slot still holds the item of the last lap */
+			return 0;
+		} else {
+			/* another producer claimed it */
+			pos = atomic_load_explicit(&q->tail,
+						   memory_order_relaxed);
+		}
+	}
+	slot->item = item;
+	atomic_store_explicit(&slot->seq, 2 * pos + 1, memory_order_release);
+	return 1;
+}
+
+/* takes the item at the head, if there is one */
+static void *
+queue_take(struct queue *q)
+{
+	unsigned long pos = atomic_load_explicit(&q->head,
+						 memory_order_relaxed);
+	struct queue_slot *slot;
+	void *item;
+	long diff;
+
+	while (1) {
+		slot = &q->slots[pos % q->size];
+		diff = (long)(atomic_load_explicit(&slot->seq,
+						   memory_order_acquire) -
+			      (2 * pos + 1));
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+				    &q->head, &pos, pos + 1,
+				    memory_order_relaxed,
+				    memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* the item of this lap hasn't been pushed yet */
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&q->head,
+						   memory_order_relaxed);
+		}
+	}
+	item = slot->item;
+	atomic_store_explicit(&slot->seq, 2 * (pos + q->size),
+			      memory_order_release);
+	return item;
+}
+
+/* the slot at the head holds an item, or the queue is closed */
+static int
+queue_can_pop(struct queue *q)
+{
+	unsigned long pos = atomic_load_explicit(&q->head,
+						 memory_order_relaxed);
+
+	return atomic_load_explicit(&q->slots[pos % q->size].seq,
+				    memory_order_acquire) == 2 * pos + 1 ||
+		atomic_load(&q->closed);
+}
+
+/* the slot at the tail is free */
+static int
+queue_can_push(struct queue *q)
+{
+	unsigned long pos = atomic_load_explicit(&q->tail,
+						 memory_order_relaxed);
+
+	return atomic_load_explicit(&q->slots[pos % q->size].seq,
+				    memory_order_acquire) == 2 * pos;
+}
+
+/* wakes up a thread waiting on w, if there is one and no wakeup is on its way
+ * already */
+static void
+queue_wake(struct queue_waiters *w)
+{
+	/* pairs with the fence in queue_wait, either the waiter sees our
+	 * change to the queue or we see it waiting */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&w->nr_waiting) > 0 &&
+	    !atomic_exchange(&w->pending, 1)) {
+		atomic_fetch_add(&w->futex, 1);
+		futex_wake(&w->futex, 1);
+	}
+}
+
+/* sleeps on w until ready, until a wakeup, or until timeout has passed */
+static void
+queue_wait(struct queue *q, struct queue_waiters *w,
+	   int (*ready)(struct queue *), struct timespec *timeout)
+{
+	unsigned int val = atomic_load(&w->futex);
+
+	atomic_fetch_add(&w->nr_waiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!ready(q)) {
+		/* returns at once if there was a wakeup since we read val */
+		futex_wait(&w->futex, val, timeout);
+	}
+	atomic_fetch_sub(&w->nr_waiting, 1);
+	/* let the next wakeup through. a wakeup that was skipped while this
+	 * one was pending is passed on by the caller, see queue_pop. */
+	atomic_store(&w->pending, 0);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+void
+queue_push(struct queue *q, void *item)
+{
+	int waited = 0;
+
+	while (!queue_put(q, item)) {
+		/* full, wait for a consumer */
+		queue_wait(q, &q->not_full, queue_can_push, NULL);
+		waited = 1;
+	}
+	if (waited && queue_can_push(q)) {
+		/* there may be room for another waiting producer */
+		queue_wake(&q->not_full);
+	}
+	queue_wake(&q->not_empty);
+}
+
+/* pops an item, waiting until the monotonic clock reaches deadline at most.
+ * NULL deadline waits for as long as it takes. */
+static void *
+queue_pop_until(struct queue *q, struct timespec *deadline)
+{
+	struct timespec now, left, *timeout = NULL;
+	int waited = 0;
+	void *item;
+
+	while ((item = queue_take(q)) == NULL) {
+		if (atomic_load(&q->closed)) {
+			return NULL;
+		}
+		if (deadline) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left.tv_sec = deadline->tv_sec - now.tv_sec;
+			left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+			if (left.tv_nsec < 0) {
+				left.tv_sec--;
+				left.tv_nsec += 1000000000L;
+			}
+			if (left.tv_sec < 0) {
+				/* the queue was empty right now, so no wakeup
+				 * is lost */
+				return NULL;
+			}
+			timeout = &left;
+		}
+		/* empty, wait for a producer */
+		queue_wait(q, &q->not_empty, queue_can_pop, timeout);
+		waited = 1;
+	}
+	if (waited && queue_can_pop(q)) {
+		/* the items pushed while our wakeup was pending didn't wake
+		 * anyone, pass the wakeup on */
+		queue_wake(&q->not_empty);
+	}
+	queue_wake(&q->not_full);
+	return item;
+}
+
+void *
+queue_pop(struct queue *q)
+{
+	return queue_pop_until(q, NULL);
+}
+
+void *
+queue_pop_timeout(struct queue *q, int timeout_ms)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	return queue_pop_until(q, &deadline);
+}
+
+void *
+queue_try_pop(struct queue *q)
+{
+	void *item = queue_take(q);
+
+	if (item) {
+		queue_wake(&q->not_full);
+	}
+	return item;
+}
+
+int
+queue_try_push(struct queue *q, void *item)
+{
+	if (!queue_put(q, item)) {
+		return 0;
+	}
+	queue_wake(&q->not_empty);
+	return 1;
+}
+
+int
+queue_depth(struct queue *q)
+{
+	long depth = (long)(atomic_load_explicit(&q->tail,
+						 memory_order_relaxed) -
+			    atomic_load_explicit(&q->head,
+						 memory_order_relaxed));
+
+	/* head may be read after tail moved past it */
+	return depth < 0 ? 0 : depth;
+}
+
+int
+queue_closed(struct queue *q)
+{
+	return atomic_load(&q->closed);
+}
+
+void
+queue_close(struct queue *q)
+{
+	atomic_store(&q->closed, 1);
+	atomic_fetch_add(&q->not_empty.futex, 1);
+	futex_wake(&q->not_empty.futex, INT_MAX);
+}
+
+void
+queue_destroy(struct queue *q)
+{
+	free(q->slots);
+	free(q);
+}
@@ -0,0 +1,33 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+/* a bounded multi-producer multi-consumer queue of pointers. the queue itself
+ * takes no lock, threads only sleep when the queue is empty or full. */
+struct queue;
+
+struct queue *queue_init(int size);
+/* adds item, which must not be NULL, at the tail, waiting while the queue
+ * is full */
+void queue_push(struct queue *q, void *item);
+/* like queue_push, but returns 0 at once if the queue is full, 1 once item
+ * is added */
+int queue_try_push(struct queue *q, void *item);
+/* removes the item at the head, waiting while the queue is empty. returns
+ * NULL once the queue is closed and empty. */
+void *queue_pop(struct queue *q);
+/* like queue_pop, but also returns NULL if the queue stays empty for
+ * timeout_ms milliseconds. queue_closed tells the two apart. */
+void *queue_pop_timeout(struct queue *q, int timeout_ms);
+/* like queue_pop, but returns NULL at once if the queue is empty */
+void *queue_try_pop(struct queue *q);
+/* the number of items in the queue, including the ones that are being pushed
+ * or popped. this is a snapshot, which may be out of date already. */
+int queue_depth(struct queue *q);
+/* wakes up the threads waiting in queue_pop, which return the items left in
+ * the queue and then NULL. no item may be pushed after this. */
+void queue_close(struct queue *q);
+/* queue_close has been called */
+int queue_closed(struct queue *q);
+void queue_destroy(struct queue *q);
+
+#endif /* __QUEUE_H__ */
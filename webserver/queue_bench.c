@@ -0,0 +1,300 @@
+/*
+ * queue_bench.c: Microbenchmark for the connection queue.
+ *
+ * To run:
+ *  queue_bench [nr_items [max_threads]]
+ *
+ * Compares the lock-free queue in queue.c against the ring that the server
+ * used before, protected by a mutex and two condition variables, with a
+ * broadcast on every push and pop.
+ *
+ * First measures the throughput of handing over nr_items items from 1 and
+ * max_threads producers to 1, 2, 4, ... max_threads consumers. Then measures
+ * the handoff latency, from a push to the pop that returns the item, when a
+ * single producer hands over one item at a time to max_threads idle
+ * consumers, like the server's main thread does with a new connection.
+ */
+
+#include "common.h"
+#include "queue.h"
+
+#define DEFAULT_NR_ITEMS 2000000
+#define QUEUE_SIZE 64
+#define NR_LATENCY_ITEMS 20000
+
+/* the queue that the server used before, for comparison */
+struct ring {
+	void **buffer;
+	int size;
+	int in, out;
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_full;
+	pthread_cond_t cv_empty;
+};
+
+static struct ring *
+ring_init(int size)
+{
+	struct ring *r = Malloc(sizeof(struct ring));
+
+	/* to distinguish between empty and full add 1 to size */
+	r->buffer = Malloc(sizeof(void *) * (size + 1));
+	r->size = size;
+	r->in = r->out = 0;
+	r->closed = 0;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cv_full, NULL);
+	pthread_cond_init(&r->cv_empty, NULL);
+	return r;
+}
+
+static void
+ring_push(struct ring *r, void *item)
+{
+	pthread_mutex_lock(&r->lock);
+	while ((r->in - r->out + r->size + 1) % (r->size + 1) == r->size) {
+		pthread_cond_wait(&r->cv_full, &r->lock);
+	}
+	r->buffer[r->in] = item;
+	r->in = (r->in + 1) % (r->size + 1);
+	pthread_cond_broadcast(&r->cv_empty);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void *
+ring_pop(struct ring *r)
+{
+	void *item;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->in == r->out) {
+		if (r->closed) {
+			pthread_mutex_unlock(&r->lock);
+			return NULL;
+		}
+		pthread_cond_wait(&r->cv_empty, &r->lock);
+	}
+	item = r->buffer[r->out];
+	r->out = (r->out + 1) % (r->size + 1);
+	pthread_cond_broadcast(&r->cv_full);
+	pthread_mutex_unlock(&r->lock);
+	return item;
+}
+
+static void
+ring_close(struct ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->closed = 1;
+	pthread_cond_broadcast(&r->cv_empty);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void
+ring_destroy(struct ring *r)
+{
+	free(r->buffer);
+	free(r);
+}
+
+/* the two queues behind one interface */
+struct bench_queue {
+	char *name;
+	void *(*init)(int size);
+	void (*push)(void *q, void *item);
+	void *(*pop)(void *q);
+	void (*close)(void *q);
+	void (*destroy)(void *q);
+};
+
+static struct bench_queue queues[] = {
+	{ "mutex ring", (void *)ring_init, (void *)ring_push, (void *)ring_pop,
+	  (void *)ring_close, (void *)ring_destroy },
+	{ "lock-free", (void *)queue_init, (void *)queue_push,
+	  (void *)queue_pop, (void *)queue_close, (void *)queue_destroy },
+};
+
+struct bench_thread {
+	struct bench_queue *bq;
+	void *q;
+	int nr_items;		/* pushed by a producer */
+	double *latencies;	/* of the items popped by a consumer */
+	int nr_latencies;
+};
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+static void *
+bench_producer(void *arg)
+{
+	struct bench_thread *bt = arg;
+	long i;
+
+	for (i = 1; i <= bt->nr_items; i++) {
+		bt->bq->push(bt->q, (void *)i);
+	}
+	return NULL;
+}
+
+static void *
+bench_consumer(void *arg)
+{
+	struct bench_thread *bt = arg;
+
+	while (bt->bq->pop(bt->q) != NULL)
+		;
+	return NULL;
+}
+
+/* returns the items handed over per second */
+static double
+bench_throughput(struct bench_queue *bq, int nr_items, int nr_producers,
+		 int nr_consumers)
+{
+	pthread_t producers[nr_producers], consumers[nr_consumers];
+	struct bench_thread bt[nr_producers + nr_consumers];
+	struct timespec start, end;
+	void *q = bq->init(QUEUE_SIZE);
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_consumers; i++) {
+		bt[i].bq = bq;
+		bt[i].q = q;
+		pthread_create(&consumers[i], NULL, bench_consumer, &bt[i]);
+	}
+	for (i = 0; i < nr_producers; i++) {
+		struct bench_thread *p = &bt[nr_consumers + i];
+
+		p->bq = bq;
+		p->q = q;
+		p->nr_items = nr_items / nr_producers;
+		pthread_create(&producers[i], NULL, bench_producer, p);
+	}
+	for (i = 0; i < nr_producers; i++) {
+		pthread_join(producers[i], NULL);
+	}
+	bq->close(q);
+	for (i = 0; i < nr_consumers; i++) {
+		pthread_join(consumers[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	bq->destroy(q);
+	/* each producer pushes the same number of items */
+	return (double)(nr_items / nr_producers * nr_producers) /
+		elapsed_ns(&start, &end) * 1e9;
+}
+
+static void *
+bench_latency_consumer(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct timespec *pushed, now;
+
+	while ((pushed = bt->bq->pop(bt->q)) != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		bt->latencies[bt->nr_latencies++] = elapsed_ns(pushed, &now);
+		free(pushed);
+	}
+	return NULL;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* hands over items one at a time, so the consumers are idle when an item
+ * arrives. prints the mean and the 99th percentile handoff latency. */
+static void
+bench_latency(struct bench_queue *bq, int nr_consumers)
+{
+	pthread_t consumers[nr_consumers];
+	struct bench_thread bt[nr_consumers];
+	double *all, sum = 0;
+	void *q = bq->init(QUEUE_SIZE);
+	int i, j, n = 0;
+
+	for (i = 0; i < nr_consumers; i++) {
+		bt[i].bq = bq;
+		bt[i].q = q;
+		bt[i].latencies = Malloc(sizeof(double) * NR_LATENCY_ITEMS);
+		bt[i].nr_latencies = 0;
+		pthread_create(&consumers[i], NULL, bench_latency_consumer,
+			       &bt[i]);
+	}
+	for (i = 0; i < NR_LATENCY_ITEMS; i++) {
+		struct timespec *pushed = Malloc(sizeof(struct timespec));
+
+		/* let the consumers go back to sleep */
+		usleep(50);
+		clock_gettime(CLOCK_MONOTONIC, pushed);
+		bq->push(q, pushed);
+	}
+	bq->close(q);
+	all = Malloc(sizeof(double) * NR_LATENCY_ITEMS);
+	for (i = 0; i < nr_consumers; i++) {
+		pthread_join(consumers[i], NULL);
+		for (j = 0; j < bt[i].nr_latencies; j++) {
+			all[n++] = bt[i].latencies[j];
+			sum += bt[i].latencies[j];
+		}
+		free(bt[i].latencies);
+	}
+	assert(n == NR_LATENCY_ITEMS);
+	qsort(all, n, sizeof(double), compare_double);
+	printf("%-10s %2d consumers: mean = %8.0f ns, p99 = %8.0f ns\n",
+	       bq->name, nr_consumers, sum / n, all[n * 99 / 100]);
+	free(all);
+	bq->destroy(q);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nr_items = DEFAULT_NR_ITEMS, max_threads = 8;
+	int nr_queues = sizeof(queues) / sizeof(queues[0]);
+	int i, p, c;
+
+	if (argc > 1)
+		nr_items = atoi(argv[1]);
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (nr_items <= 0 || max_threads <= 0) {
+		fprintf(stderr, "Usage: %s [nr_items [max_threads]]\n",
+			argv[0]);
+		exit(1);
+	}
+
+	printf("throughput, %d items through a queue of %d:\n", nr_items,
+	       QUEUE_SIZE);
+	for (p = 1; p <= max_threads; p = (p == 1 ? max_threads : p + 1)) {
+		for (c = 1; c <= max_threads; c *= 2) {
+			for (i = 0; i < nr_queues; i++) {
+				printf("%-10s %2d producers %2d consumers: "
+				       "%6.2f M items/s\n", queues[i].name, p,
+				       c, bench_throughput(&queues[i],
+							   nr_items, p, c) /
+				       1e6);
+			}
+		}
+		if (max_threads == 1)
+			break;
+	}
+
+	printf("handoff latency, %d items one at a time:\n",
+	       NR_LATENCY_ITEMS);
+	for (i = 0; i < nr_queues; i++) {
+		bench_latency(&queues[i], max_threads);
+	}
+	return 0;
+}
@@ -1,70 +1,246 @@
 /*
  * request.c: Does the bulk of the work for the web server.
+ *
+ * Client sockets are non-blocking. A request is read with request_read and
+ * its response written with request_write, which both return REQUEST_AGAIN
+ * when the socket would block and can be called again once it is ready, so a
+ * slow client doesn't hold on to a thread. The functions in between prepare
+ * the response, which is only sent by request_write.
+ *
+ * An HTTP/1.1 connection, or an HTTP/1.0 one that asks for keep-alive, stays
+ * open for more requests once the response has been written, see
+ * request_next. Clients may pipeline requests, sending the next ones before
+ * the response to the first has arrived, so buf may hold more than one
+ * request. The request line and the headers are parsed in place in buf, see
+ * http.c.
+ *
+ * Files can be read by an asynchronous loader, see loader.c, instead of on the
+ * thread that handles the request. request_readfile then waits for the
+ * loader, and request_readfile_async returns at once.
  */
 
 #include "common.h"
 #include "request.h"
+#include "checksum.h"
+#include "loader.h"
+#include "pool.h"
+#include "http.h"
+
+/* reading a file that isn't empty takes this long at least, in microseconds,
+ * to simulate a slow disk. otherwise, file caching doesn't have much benefit
+ * because a lot of the time is spent in processing (see request_processfile
+ * below) and so request_readfile does not have much impact. */
+#define DISK_DELAY 10000
+
+/* A mapped file is shared with the file system: reading a page past the end
+ * of a file that was truncated since it was mapped raises SIGBUS. So the files
+ * that are served must not change while they are mapped in the cache. The
+ * size and mtime of a mapped file are checked before each response that
+ * touches it, and a file that changed is read again for that response, which
+ * catches all but the changes that race with the response itself. */
+
+/* the loader that reads files, NULL to read them on the calling thread */
+static struct loader *request_loader;
+
+/* file_data and requests are allocated from pools, which last as long as the
+ * process */
+static struct pool *file_data_pool;
+static struct pool *request_pool;
+static struct pool *request_load_pool;	/* once there is a loader */
+static pthread_once_t request_pools_once = PTHREAD_ONCE_INIT;
 
 struct request {
 	int fd;		 /* descriptor for client connection */
-	struct file_data *data;
+	struct file_data *data;	/* the request holds a reference */
+	/* the request is read into buf, up to the empty line that ends it */
+	char buf[MAXBUF];
+	int buf_len;
+	int req_len;	 /* length of the request, once it has been read */
+	/* buf_len when the request was last found incomplete, 0 if it
+	 * hasn't been parsed yet, see http_parse_request */
+	int scanned;
+	int keepalive;	 /* keep the connection open after the response */
+	int minor_version;	/* x of the request's HTTP/1.x */
+	/* the response still to be written: the buffers in iov, followed by
+	 * src_left bytes of src_fd, sent by the kernel with sendfile */
+	char *out;	 /* buffer owned by the request, or NULL */
+	struct iovec iov[4];
+	int iovcnt;
+	int src_fd;	 /* -1 if no file is sent with sendfile */
+	off_t src_offset;
+	size_t src_left;
 };
 
-/* requestError(fd, filename, "404", "Not found", 
- *		"OS server could not find this file");
- */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_pools_init(void)
 {
-	char buf[MAXLINE], body[MAXBUF];
-	int i;
-	unsigned int csum = 0;
+	file_data_pool = pool_init("file_data", sizeof(struct file_data));
+	request_pool = pool_init("request", sizeof(struct request));
+}
 
-	/* create the body of the error message */
-	sprintf(body, "<html><title>OS Web Server Error</title>");
-	sprintf(body + strlen(body), "<body bgcolor=" "fffff" ">\r\n");
-	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", errnum, shortmsg);
-	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", longmsg, cause);
-	sprintf(body + strlen(body), "</body></html>\r\n");
+/* initialize file data */
+struct file_data *
+file_data_init(void)
+{
+	struct file_data *data;
 
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	pthread_once(&request_pools_once, request_pools_init);
+	data = pool_alloc(file_data_pool);
+	data->file_name = NULL;
+	data->file_buf = NULL;
+	data->file_size = 0;
+	data->mapped = 0;
+	data->file_mtime.tv_sec = 0;
+	data->file_mtime.tv_nsec = 0;
+	data->file_csum = 0;
+	data->header = NULL;
+	data->header_size = 0;
+	atomic_init(&data->refcnt, 1);
+	return data;
+}
 
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+/* free all file data */
+static void
+file_data_free(struct file_data *data)
+{
+	if (data->file_name != data->file_name_buf) {
+		free(data->file_name);
+	}
+	if (data->mapped) {
+		SYS(munmap(data->file_buf, data->file_size));
+	} else {
+		free(data->file_buf);
+	}
+	free(data->header);
+	pool_free(file_data_pool, data);
+}
 
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+/* the name is copied into the file_data if it fits, so that most files need
+ * no allocation for it */
+void
+file_data_set_name(struct file_data *data, char *name)
+{
+	size_t len = strlen(name);
 
-	/* generate a very trivial checksum */
-	for (i = 0; i < strlen(body); i++) {
-		csum += (unsigned char)(body[i]);
+	assert(data->file_name == NULL);
+	if (len < FILE_NAME_INLINE) {
+		data->file_name = data->file_name_buf;
+		memcpy(data->file_name, name, len + 1);
+	} else {
+		data->file_name = strdup(name);
+		assert(data->file_name);
 	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+}
 
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+/* pin the file, e.g., while it is being sent */
+void
+file_data_get(struct file_data *data)
+{
+	atomic_fetch_add_explicit(&data->refcnt, 1, memory_order_relaxed);
+}
 
+/* unpin the file, freeing it when this was the last reference */
+void
+file_data_put(struct file_data *data)
+{
+	if (atomic_fetch_sub_explicit(&data->refcnt, 1,
+				      memory_order_acq_rel) == 1) {
+		file_data_free(data);
+	}
 }
 
-/* reads and discards everything up to an empty text line */
+/* a mapped file takes up whole pages */
+int
+file_data_mem_size(struct file_data *data)
+{
+	long page_size;
+
+	if (!data->mapped) {
+		return data->file_size;
+	}
+	page_size = sysconf(_SC_PAGESIZE);
+	return (data->file_size + page_size - 1) / page_size * page_size;
+}
+
+/* starts the response with header, of size bytes */
 static void
-request_read_headers(struct rio *rp)
+request_queue_header(struct request *rq, char *header, int size)
 {
-	char buf[MAXLINE];
+	static char keepalive[] = "Connection: keep-alive\r\n\r\n";
+	static char *versions[] = { "HTTP/1.0", "HTTP/1.1" };
+	int len = strlen(versions[0]);
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	/* the header of a file is shared by all its responses, so the parts
+	 * that depend on the request are buffers of their own. the header
+	 * starts with HTTP/1.0, and the response has the request's version
+	 * instead. */
+	assert(size > len && memcmp(header, versions[0], len) == 0);
+	rq->iov[0].iov_base = versions[rq->minor_version >= 1];
+	rq->iov[0].iov_len = len;
+	rq->iov[1].iov_base = header + len;
+	rq->iov[1].iov_len = size - len;
+	rq->iovcnt = 2;
+	if (rq->keepalive) {
+		/* the connection header is sent before the empty line that
+		 * ends the header */
+		rq->iov[1].iov_len -= 2;
+		rq->iov[2].iov_base = keepalive;
+		rq->iov[2].iov_len = sizeof(keepalive) - 1;
+		rq->iovcnt = 3;
+	}
+}
+
+/* makes buf, owned by the request, the response. the response header takes
+ * the first header_size bytes of its size bytes. */
+static void
+request_respond(struct request *rq, char *buf, int header_size, int size)
+{
+	free(rq->out);
+	rq->out = buf;
+	request_queue_header(rq, buf, header_size);
+	if (size > header_size) {
+		rq->iov[rq->iovcnt].iov_base = buf + header_size;
+		rq->iov[rq->iovcnt].iov_len = size - header_size;
+		rq->iovcnt++;
 	}
-	return;
+}
+
+/* requestError(rq, filename, "404", "Not found", 
+ *		"OS server could not find this file");
+ */
+static void
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
+{
+	char body[MAXBUF];
+	char *buf = Malloc(2 * MAXBUF);
+	unsigned int csum;
+	int size = 0, header_size;
+
+	/* the connection is closed after an error */
+	rq->keepalive = 0;
+
+	/* create the body of the error message */
+	sprintf(body, "<html><title>OS Web Server Error</title>");
+	sprintf(body + strlen(body), "<body bgcolor=" "fffff" ">\r\n");
+	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", errnum, shortmsg);
+	snprintf(body + strlen(body), MAXBUF - strlen(body),
+		 "<p>%s: %.512s</p>\r\n</body></html>\r\n", longmsg, cause);
+
+	/* write out the header information for this response */
+	size += sprintf(buf + size, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+	size += sprintf(buf + size, "Content-Type: text/html\r\n");
+	size += sprintf(buf + size, "Content-Length: %ld\r\n", strlen(body));
+	/* generate a very trivial checksum */
+	csum = checksum(body, strlen(body));
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+	printf("%s", buf);
+	header_size = size;
+
+	/* write out the content */
+	size += sprintf(buf + size, "%s", body);
+	printf("%s", body);
+	request_respond(rq, buf, header_size, size);
 }
 
 
@@ -76,9 +252,9 @@ request_read_headers(struct rio *rp)
  *
  * Also, we don't serve files with a .. in the path (see request_readfile). */
 static void
-request_parse_URI(char *uri, char *filename, size_t max)
+request_parse_URI(struct http_slice *uri, char *filename, size_t max)
 {
-	snprintf(filename, max, "./%s", uri);
+	snprintf(filename, max, "./%.*s", uri->len, uri->p);
 }
 
 /* Fills in the filetype given the filename */
@@ -96,175 +272,849 @@ request_get_file_type(char *filename, char *filetype)
 }
 
 /* entry point to this file */
-/* returns a pointer to a request struct, filling rq->fd with connfd,
- * and rq->file_name with the file that is being requested.
- * Returns NULL on failure.
+/* returns a pointer to a request struct for the non-blocking connection
+ * connfd. the request takes over the caller's reference on data, and fills
+ * in data->file_name with the file that is being requested once it has been
+ * read by request_read.
  */
 struct request *
 request_init(int connfd, struct file_data *data)
 {
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
 	struct request *rq;
 
 	assert(data);
-	rq = Malloc(sizeof(struct request));
+	pthread_once(&request_pools_once, request_pools_init);
+	rq = pool_alloc(request_pool);
 	rq->fd = connfd;
 	rq->data = data;
-	data->file_name = Malloc(MAXLINE);
-	data->file_buf = NULL;
-	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
-
-	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
-	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
-			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
-		request_destroy(rq);
-		return NULL;
-	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
+	rq->buf_len = 0;
+	rq->buf[0] = 0;
+	rq->req_len = 0;
+	rq->scanned = 0;
+	rq->keepalive = 0;
+	rq->minor_version = 0;
+	rq->out = NULL;
+	rq->iovcnt = 0;
+	rq->src_fd = -1;
+	rq->src_left = 0;
 	return rq;
 }
 
+/* looks for Connection headers in the headers of the request */
+static void
+request_parse_headers(struct request *rq, struct http_request *req)
+{
+	struct http_header *h;
+	int i;
+
+	for (i = 0; i < req->nr_headers; i++) {
+		h = &req->headers[i];
+		if (!http_slice_equals(&h->name, "Connection")) {
+			continue;
+		}
+		if (http_has_token(&h->value, "close")) {
+			rq->keepalive = 0;
+		} else if (http_has_token(&h->value, "keep-alive")) {
+			rq->keepalive = 1;
+		}
+	}
+}
+
+/* handles a request that has been parsed into req */
+static int
+request_parse(struct request *rq, struct http_request *req)
+{
+	char method[MAXLINE], file_name[MAXLINE];
+	struct file_data *data = rq->data;
+
+	/* HTTP/1.1 connections are persistent unless the client says
+	 * otherwise, HTTP/1.0 ones only if it asks */
+	rq->minor_version = req->minor_version;
+	rq->keepalive = req->minor_version >= 1;
+	request_parse_headers(rq, req);
+
+	if (!http_slice_equals(&req->method, "GET")) {
+		snprintf(method, sizeof(method), "%.*s", req->method.len,
+			 req->method.p);
+		request_error(rq, method, "501", "Not Implemented",
+			      "OS Web Server does not implement this method");
+		return REQUEST_FAILED;
+	}
+	request_parse_URI(&req->uri, file_name, sizeof(file_name));
+	file_data_set_name(data, file_name);
+	return REQUEST_DONE;
+}
+
+/* reads the request line and the headers, up to the empty line.
+ * Returns REQUEST_DONE once data->file_name has been filled in.
+ * Returns REQUEST_AGAIN when more of the request has yet to arrive.
+ * Returns REQUEST_FAILED for a bad request, an error response is ready to be
+ * written.
+ * Returns REQUEST_CLOSED if the client went away. */
+int
+request_read(struct request *rq)
+{
+	struct http_request req;
+	ssize_t n;
+	int ret;
+
+	while (1) {
+		/* a pipelined request may have been read along with the last
+		 * one already */
+		ret = http_parse_request(rq->buf, rq->buf_len, rq->scanned, &req);
+		if (ret > 0) {
+			rq->req_len = ret;
+			return request_parse(rq, &req);
+		}
+		if (ret == HTTP_BAD) {
+			request_error(rq, "request", "400", "Bad Request",
+				      "OS Web Server could not parse this "
+				      "request");
+			return REQUEST_FAILED;
+		}
+		rq->scanned = rq->buf_len;
+		if (rq->buf_len == sizeof(rq->buf) - 1) {
+			request_error(rq, "request", "400", "Bad Request",
+				      "OS Web Server could not read this "
+				      "long");
+			return REQUEST_FAILED;
+		}
+		n = read(rq->fd, rq->buf + rq->buf_len,
+			 sizeof(rq->buf) - 1 - rq->buf_len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return REQUEST_AGAIN;
+			return REQUEST_CLOSED;
+		}
+		if (n == 0) {
+			return REQUEST_CLOSED;
+		}
+		rq->buf_len += n;
+		rq->buf[rq->buf_len] = 0;
+	}
+}
+
+/* writes as much of the response as the socket takes.
+ * Returns REQUEST_DONE once the whole response has been written.
+ * Returns REQUEST_AGAIN if the socket would block.
+ * Returns REQUEST_CLOSED if the client went away. */
+int
+request_write(struct request *rq)
+{
+	struct msghdr msg;
+	ssize_t n;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	while (rq->iovcnt > 0) {
+		msg.msg_iov = rq->iov;
+		msg.msg_iovlen = rq->iovcnt;
+		/* MSG_MORE keeps a short header from being sent in a packet
+		 * of its own when the file follows with sendfile */
+		n = sendmsg(rq->fd, &msg, MSG_NOSIGNAL |
+			    (rq->src_left ? MSG_MORE : 0));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return REQUEST_AGAIN;
+			return REQUEST_CLOSED;
+		}
+		/* skip the buffers that were written completely */
+		for (i = 0; i < rq->iovcnt && n >= rq->iov[i].iov_len; i++) {
+			n -= rq->iov[i].iov_len;
+		}
+		memmove(rq->iov, rq->iov + i, (rq->iovcnt - i) *
+			sizeof(struct iovec));
+		rq->iovcnt -= i;
+		if (rq->iovcnt > 0) {
+			rq->iov[0].iov_base = (char *)rq->iov[0].iov_base + n;
+			rq->iov[0].iov_len -= n;
+		}
+	}
+	while (rq->src_left > 0) {
+		/* sendfile updates src_offset */
+		n = sendfile(rq->fd, rq->src_fd, &rq->src_offset,
+			     rq->src_left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return REQUEST_AGAIN;
+			return REQUEST_CLOSED;
+		}
+		if (n == 0) {
+			return REQUEST_CLOSED; /* the file shrunk */
+		}
+		rq->src_left -= n;
+	}
+	return REQUEST_DONE;
+}
+
+/* the connection is kept open after the response has been written */
+int
+request_keepalive(struct request *rq)
+{
+	return rq->keepalive;
+}
+
+/* the number of bytes of the following requests that have been read
+ * already, once request_next has been called */
+int
+request_pending(struct request *rq)
+{
+	return rq->buf_len;
+}
+
+/* frees the response */
+static void
+request_release(struct request *rq)
+{
+	if (rq->src_fd >= 0) {
+		/* ask the kernel to stop caching the file */
+		SYS(posix_fadvise(rq->src_fd, 0, 0, POSIX_FADV_DONTNEED));
+		SYS(close(rq->src_fd));
+		rq->src_fd = -1;
+	}
+	free(rq->out);
+	rq->out = NULL;
+	file_data_put(rq->data);
+}
+
+/* gets a request ready for the next request on its connection, once the
+ * response has been written. the request takes over the caller's reference
+ * on data, like request_init. */
+void
+request_next(struct request *rq, struct file_data *data)
+{
+	assert(data);
+	request_release(rq);
+	rq->data = data;
+	/* keep the pipelined requests that were read along with this one */
+	rq->buf_len -= rq->req_len;
+	memmove(rq->buf, rq->buf + rq->req_len, rq->buf_len + 1);
+	rq->req_len = 0;
+	rq->scanned = 0;
+	rq->keepalive = 0;
+	rq->minor_version = 0;
+	rq->iovcnt = 0;
+	rq->src_left = 0;
+}
+
 void
 request_destroy(struct request *rq)
 {
 	assert(rq);
+	request_release(rq);
 	/* close the connection fd */
 	SYS(close(rq->fd));
-	free(rq);
+	pool_free(request_pool, rq);
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
-int
-request_readfile(struct request *rq)
+/* puts together the response header for a file into buf, returns its
+ * length */
+static int
+request_header(char *buf, struct file_data *data)
 {
-	int srcfd;
-	struct stat sbuf;
-	struct file_data *data;
-	char *ext;
+	char filetype[MAXLINE];
+	int size = 0;
 
-	data = rq->data;
-	assert(data);
+	request_get_file_type(data->file_name, filetype);
+	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
+	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n",
+			data->file_csum);
+	return size;
+}
+
+/* puts together the response header that is sent with a file whose checksum
+ * is known */
+static void
+request_prepare_header(struct file_data *data)
+{
+	char buf[MAXBUF];
+	int size;
+
+	size = request_header(buf, data);
+	data->header = Malloc(size);
+	memcpy(data->header, buf, size);
+	data->header_size = size;
+}
+
+/* computes the checksum of a file that has been read, and puts together the
+ * response header that is sent with the file */
+static void
+request_prepare_response(struct file_data *data)
+{
+	/* generate a very trivial checksum */
+	data->file_csum = checksum(data->file_buf, data->file_size);
+	request_prepare_header(data);
+}
+
+/* returns why the file may not be served because of its name, or NULL if it
+ * may be */
+static char *
+request_name_error(char *file_name)
+{
+	char *ext;
 
 	/* don't serve files that start with /, or .., or end in .c */
-	if (data->file_name[0] == '/') {
+	if (file_name[0] == '/') {
 		/* this shouldn't really happen because we add a "./" at the
 		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with absolute paths");
-		return 0;
+		return "OS Web Server doesn't serve files with absolute paths";
 	}
-	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with .. in the path");
-		return 0;
+	if (strstr(file_name, "..") != NULL) {
+		return "OS Web Server doesn't serve files with .. in the path";
 	}
-	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
+	if (((ext = strrchr(file_name, '.')) != NULL) && 
 	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve C or header files ");
+		return "OS Web Server doesn't serve C or header files ";
+	}
+	return NULL;
+}
+
+/* checks that the name of the requested file may be served.
+ * Returns 0 on failure, the error response is ready to be written. */
+static int
+request_checkname(struct request *rq)
+{
+	char *error;
+
+	assert(rq->data);
+	if ((error = request_name_error(rq->data->file_name)) != NULL) {
+		request_error(rq, rq->data->file_name, "404", "Not found",
+			      error);
 		return 0;
 	}
+	return 1;
+}
 
-	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server could not find this file");
+/* checks that the requested file, of type and permissions mode, may be read.
+ * Returns 0 on failure, the error response is ready to be written. */
+static int
+request_checkmode(struct request *rq, mode_t mode)
+{
+	if (!(S_ISREG(mode)) || !(S_IRUSR & mode)) {
+		request_error(rq, rq->data->file_name, "403", "Forbidden",
+			      "OS Web Server could not read this file");
 		return 0;
 	}
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
+	return 1;
+}
+
+/* prepares the error response for a file that could not be stat'ed, opened
+ * or read, with the errno of the call that failed */
+static void
+request_file_error(struct request *rq, int error)
+{
+	if (error == ENOENT || error == ENOTDIR) {
+		request_error(rq, rq->data->file_name, "404", "Not found",
+			      "OS Web Server could not find this file");
+	} else if (error == EACCES || error == EPERM) {
+		request_error(rq, rq->data->file_name, "403", "Forbidden",
 			      "OS Web Server could not read this file");
+	} else {
+		request_error(rq, rq->data->file_name, "500",
+			      "Internal Server Error",
+			      "OS Web Server could not read this file");
+	}
+}
+
+/* checks that the requested file may be served, and stats it.
+ * Returns 0 on failure, the error response is ready to be written. */
+static int
+request_checkfile(struct request *rq, struct stat *sbuf)
+{
+	if (!request_checkname(rq)) {
+		return 0;
+	}
+	if (stat(rq->data->file_name, sbuf) < 0) {
+		request_file_error(rq, errno);
 		return 0;
 	}
+	return request_checkmode(rq, sbuf->st_mode);
+}
 
-	data->file_size = sbuf.st_size;
+/* like the read path, waits DISK_DELAY for the pages of a mapped file that
+ * have to come from the disk, in proportion. the read path drops the file from
+ * the page cache after reading it, so that it always pays the whole delay. */
+static void
+request_map_delay(struct file_data *data)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	int nr_pages = (data->file_size + page_size - 1) / page_size;
+	unsigned char *vec = Malloc(nr_pages);
+	int i, nr_missing = 0;
+
+	if (mincore(data->file_buf, data->file_size, vec) < 0) {
+		nr_missing = nr_pages;
+	} else {
+		for (i = 0; i < nr_pages; i++) {
+			nr_missing += !(vec[i] & 1);
+		}
+	}
+	free(vec);
+	if (nr_missing > 0) {
+		usleep((long)DISK_DELAY * nr_missing / nr_pages);
+	}
+}
+
+/* reads data->file_name, of data->file_size bytes, into the heap, or maps it
+ * if map is set, and prepares the response. returns 0 with errno set if the
+ * file can't be opened or read, e.g., if it was removed since it was stat'ed.
+ * a file that shrunk since then is read up to its new end. */
+static int
+request_readdata(struct file_data *data, int map)
+{
+	int srcfd, size = 0, error;
+	struct stat sbuf;
+	ssize_t n = 0;
 
 	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
+		if ((srcfd = open(data->file_name, O_RDONLY, 0)) < 0) {
+			return 0;
+		}
+		if (map) {
+			/* the file is mapped as it is now, the pages past its
+			 * end would raise SIGBUS if it shrunk */
+			SYS(fstat(srcfd, &sbuf));
+			data->file_size = sbuf.st_size;
+			data->file_mtime = sbuf.st_mtim;
+		}
+		if (map && data->file_size > 0) {
+			/* the pages are shared with the kernel's page cache,
+			 * and with every other process that maps the file */
+			data->file_buf = mmap(NULL, data->file_size, PROT_READ,
+					      MAP_SHARED, srcfd, 0);
+			if (data->file_buf == MAP_FAILED) {
+				error = errno;
+				data->file_buf = NULL;
+				SYS(close(srcfd));
+				errno = error;
+				return 0;
+			}
+			data->mapped = 1;
+			/* the pages that are missing now are the ones that
+			 * are read from the disk */
+			request_map_delay(data);
+			/* start reading the whole file in, rather than
+			 * faulting it in page by page */
+			SYS(madvise(data->file_buf, data->file_size,
+				    MADV_WILLNEED));
+		} else if (!map) {
+			data->file_buf = Malloc(data->file_size);
+			while (size < data->file_size) {
+				n = read(srcfd, data->file_buf + size,
+					 data->file_size - size);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					break;
+				}
+				size += n;
+			}
+			if (n < 0) {
+				error = errno;
+				SYS(close(srcfd));
+				errno = error;
+				return 0;
+			}
+			data->file_size = size;
+			/* ask the kernel to stop caching the file */
+			SYS(posix_fadvise(srcfd, 0, data->file_size, 
+					  POSIX_FADV_DONTNEED));
+			/* we do this to simulate a slow disk */
+			usleep(DISK_DELAY);
+		}
 		SYS(close(srcfd));
-		/* we do this to simulate a slow disk. otherwise, file caching
-		 * doesn't have much benefit because a lot of the time is spent
-		 * in processing (see request_processfile below) and so
-		 * request_readfile does not have much impact. */
-		usleep(10000);
+	}
+	request_prepare_response(data);
+	return 1;
+}
+
+/* reads the file into the heap, or maps it if map is set */
+static int
+request_loadfile(struct request *rq, int map)
+{
+	struct stat sbuf;
+
+	if (!request_checkfile(rq, &sbuf)) {
+		return 0;
+	}
+	rq->data->file_size = sbuf.st_size;
+	rq->data->file_mtime = sbuf.st_mtim;
+	if (!request_readdata(rq->data, map)) {
+		request_file_error(rq, errno);
+		return 0;
+	}
+	return 1;
+}
+
+/* reads in a file that no request asked for, e.g., to warm up the cache,
+ * into the heap, or maps it if map is set. the name is as formed by the
+ * server, e.g. ./fileset_dir/00001. returns the file with a reference held by
+ * the caller, or NULL if it may not be served or could not be read. */
+struct file_data *
+request_preloadfile(char *file_name, int map)
+{
+	struct file_data *data;
+	struct stat sbuf;
+
+	/* the cache is looked up before the name is checked, so it must only
+	 * hold files that may be served */
+	if (request_name_error(file_name) != NULL ||
+	    stat(file_name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+	    !(S_IRUSR & sbuf.st_mode)) {
+		return NULL;
+	}
+	data = file_data_init();
+	file_data_set_name(data, file_name);
+	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtim;
+	if (!request_readdata(data, map)) {
+		file_data_put(data);
+		return NULL;
+	}
+	return data;
+}
+
+/* restores a file that was cached by an earlier run of the server, as
+ * recorded by a snapshot of its cache: size bytes, modified at mtime, with
+ * checksum csum. returns NULL if the file changed since, may not be served, or
+ * could not be read.
+ * with map, the file is mapped without reading it, and the checksum is taken
+ * from the snapshot. the pages are read when the file is first sent, if the
+ * earlier run didn't leave them in the kernel's page cache. */
+struct file_data *
+request_restorefile(char *file_name, int size, struct timespec mtime,
+		    unsigned int csum, int map)
+{
+	struct file_data *data;
+	struct stat sbuf;
+	int srcfd;
+
+	if (request_name_error(file_name) != NULL ||
+	    stat(file_name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+	    !(S_IRUSR & sbuf.st_mode) || sbuf.st_size != size ||
+	    sbuf.st_mtim.tv_sec != mtime.tv_sec ||
+	    sbuf.st_mtim.tv_nsec != mtime.tv_nsec) {
+		return NULL;
+	}
+	data = file_data_init();
+	file_data_set_name(data, file_name);
+	data->file_size = size;
+	data->file_mtime = mtime;
+	if (!map || size == 0) {
+		/* the file changed within the resolution of its mtime */
+		if (!request_readdata(data, 0) || data->file_csum != csum) {
+			file_data_put(data);
+			return NULL;
+		}
+		return data;
+	}
+	if ((srcfd = open(file_name, O_RDONLY, 0)) < 0) {
+		file_data_put(data);
+		return NULL;
+	}
+	data->file_buf = mmap(NULL, size, PROT_READ, MAP_SHARED, srcfd, 0);
+	SYS(close(srcfd));
+	if (data->file_buf == MAP_FAILED) {
+		data->file_buf = NULL;
+		file_data_put(data);
+		return NULL;
+	}
+	data->mapped = 1;
+	data->file_csum = csum;
+	request_prepare_header(data);
+	return data;
+}
+
+/* a file read by the loader for a request */
+struct request_load {
+	struct load ld;		/* first, the loader passes it back */
+	struct request *rq;
+	void (*done)(void *arg, int ret);
+	void *arg;
+};
+
+static void
+request_load_done(struct load *ld)
+{
+	struct request_load *rl = (struct request_load *)ld;
+	struct request *rq = rl->rq;
+	struct file_data *data = rq->data;
+	int ret = 0;
+
+	if (ld->error) {
+		request_file_error(rq, ld->error);
+	} else if (request_checkmode(rq, ld->mode)) {
+		data->file_buf = ld->buf;
+		data->file_size = ld->size;
+		data->file_mtime = ld->mtime;
+		request_prepare_response(data);
+		ret = 1;
+	}
+	rl->done(rl->arg, ret);
+	pool_free(request_load_pool, rl);
+}
+
+/* like request_readfile, but returns before the file has been read if there
+ * is a loader. done is then called with arg and the result of
+ * request_readfile from a thread of the loader, and until then the request
+ * must be left alone. */
+void
+request_readfile_async(struct request *rq, void (*done)(void *arg, int ret),
+		       void *arg)
+{
+	struct request_load *rl;
+
+	if (request_loader == NULL) {
+		done(arg, request_loadfile(rq, 0));
+		return;
+	}
+	if (!request_checkname(rq)) {
+		done(arg, 0);
+		return;
+	}
+	rl = pool_alloc(request_load_pool);
+	rl->ld.file_name = rq->data->file_name;
+	rl->ld.done = request_load_done;
+	rl->rq = rq;
+	rl->done = done;
+	rl->arg = arg;
+	loader_submit(request_loader, &rl->ld);
+}
+
+/* request_readfile waits for the loader on this */
+struct request_wait {
+	sem_t sem;
+	int ret;
+};
+
+static void
+request_wait_done(void *arg, int ret)
+{
+	struct request_wait *w = arg;
+
+	w->ret = ret;
+	sem_post(&w->sem);
+}
+
+/* read in filename corresponding to request. 
+ * Returns 1 on success, and fills rq->file_buf, rq->file_size and the
+ * response header.
+ * Returns 0 on failure, the error response is ready to be written. */
+int
+request_readfile(struct request *rq)
+{
+	struct request_wait w;
+
+	if (request_loader == NULL) {
+		return request_loadfile(rq, 0);
+	}
+	sem_init(&w.sem, 0, 0);
+	request_readfile_async(rq, request_wait_done, &w);
+	while (sem_wait(&w.sem) < 0) {
+		assert(errno == EINTR);
+	}
+	sem_destroy(&w.sem);
+	return w.ret;
+}
+
+/* reads files with a loader from now on. uring is set to use io_uring if the
+ * kernel has it, otherwise nr_threads threads read the files. */
+void
+request_loader_start(int uring, int nr_threads)
+{
+	assert(request_loader == NULL);
+	if (request_load_pool == NULL) {
+		request_load_pool = pool_init("request_load",
+					      sizeof(struct request_load));
+	}
+	request_loader = loader_init(uring, nr_threads, DISK_DELAY);
+}
+
+/* waits for the files that are being read, prints the statistics of the
+ * loader, and reads files on the calling thread from now on */
+void
+request_loader_stop(void)
+{
+	if (request_loader) {
+		loader_print_stats(request_loader);
+		loader_destroy(request_loader);
+		request_loader = NULL;
+	}
+}
+
+/* like request_readfile, but maps the file instead of copying it into the
+ * heap. the kernel's page cache keeps the file in memory while it is
+ * mapped. */
+int
+request_mapfile(struct request *rq)
+{
+	return request_loadfile(rq, 1);
+}
+
+/* process the size bytes of a file at buf, the main reason for this function
+ * is that if we don't do enough processing on the file, the network becomes
+ * the bottleneck, and then the various server parameters have no affect on
+ * server performance. this is a problem because we have 100 Mb/s network.
+ * With faster networks, we wouldn't have to do this artificial work. */
+static void
+request_processbuf(char *buf, int size)
+{
+	int i;
+	unsigned int dummy = 0;
+
+	for (i = 0; i < 128; i++) {
+		dummy += checksum(buf, size);
+	}
+	(void)dummy;
+}
+
+/* prepares to send the requested file without reading it into memory, the
+ * file is copied to the socket by the kernel. csum and size are the checksum
+ * and size of the file from an index written at mtime, see file_index.c. the
+ * file is processed like any other, through a mapping that is dropped before
+ * the file is sent, so there is no point in zero-copy sending a file that has
+ * been read already.
+ * Returns 1 on success.
+ * Returns 0 on failure, the error response is ready to be written.
+ * Returns -1 if the file's size does not match the index, or it was modified
+ * after the index was written, the file must then be read with
+ * request_readfile. */
+int
+request_sendfile_direct(struct request *rq, unsigned int csum, int size,
+			struct timespec mtime)
+{
+	char *buf, *map;
+	struct stat sbuf;
+	struct file_data *data;
+	int header_size, fd;
+
+	data = rq->data;
+	if (!request_checkname(rq)) {
+		return 0;
+	}
+	/* the file that is checked is the one that is sent, even if the
+	 * name is removed or replaced meanwhile. O_NONBLOCK keeps a FIFO
+	 * from blocking the open. */
+	if ((fd = open(data->file_name, O_RDONLY | O_NONBLOCK, 0)) < 0) {
+		request_file_error(rq, errno);
+		return 0;
+	}
+	SYS(fstat(fd, &sbuf));
+	if (!request_checkmode(rq, sbuf.st_mode)) {
+		SYS(close(fd));
+		return 0;
+	}
+	if (sbuf.st_size != size || sbuf.st_mtim.tv_sec > mtime.tv_sec ||
+	    (sbuf.st_mtim.tv_sec == mtime.tv_sec &&
+	     sbuf.st_mtim.tv_nsec > mtime.tv_nsec)) {
+		SYS(close(fd));
+		return -1;
+	}
+	/* the same work as for a file that is read, see request_sendfile.
+	 * the file must not shrink meanwhile, like a mapped file in the
+	 * cache. */
+	if (size > 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			SYS(close(fd));
+			return -1;
+		}
+		request_processbuf(map, size);
+		SYS(munmap(map, size));
+	}
+	data->file_size = size;
+	data->file_csum = csum;
+	buf = Malloc(MAXBUF);
+	header_size = request_header(buf, data);
+	request_respond(rq, buf, header_size, header_size);
+
+	rq->src_fd = fd;
+	rq->src_offset = 0;
+	rq->src_left = size;
+	/* we do this to simulate a slow disk, like request_readfile */
+	if (size) {
+		usleep(DISK_DELAY);
 	}
 	return 1;
 }
 
-/* if you have previous file data, you can reuse it */
+/* if you have previous file data, you can reuse it. the request takes over
+ * the caller's reference on data, and drops its reference on the file it was
+ * created with. */
 void
 request_set_data(struct request *rq, struct file_data *data)
 {
+	file_data_put(rq->data);
 	rq->data = data;
 }
 
-/* process file, the main reason for this function is that if we don't do enough
- * processing on the file, the network becomes the bottleneck, and then the
- * various server parameters have no affect on server performance. this is a
- * problem because we have 100 Mb/s network. With faster networks, we wouldn't
- * have to do this artificial work. */
+/* the file that data maps hasn't changed size or mtime since it was mapped,
+ * see the comment on mapped files above */
+static int
+request_mapping_valid(struct file_data *data)
+{
+	struct stat sbuf;
+
+	return stat(data->file_name, &sbuf) == 0 &&
+		sbuf.st_size == data->file_size &&
+		sbuf.st_mtim.tv_sec == data->file_mtime.tv_sec &&
+		sbuf.st_mtim.tv_nsec == data->file_mtime.tv_nsec;
+}
+
+/* process file, see request_processbuf */
 static void
 request_processfile(struct request *rq)
 {
 	struct file_data *data;
-	int i, j, dummy;
 	data = rq->data;
 	assert(data);
 
-	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
-		}
-	}
+	request_processbuf(data->file_buf, data->file_size);
 }
 
-/* send filename to the fd connection */
+/* prepares to send filename to the fd connection. the file must have been
+ * read by request_readfile, which prepared the response header. */
 void
 request_sendfile(struct request *rq)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
-	unsigned int csum = 0;
 	struct file_data *data;
-	long size = 0;
 
 	data = rq->data;
-	assert(data);
+	assert(data && data->header);
 
-	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	if (data->mapped && !request_mapping_valid(data)) {
+		/* read the file as it is now, for this response only. the
+		 * name is copied before the request drops the mapped file. */
+		struct file_data *copy = file_data_init();
+
+		file_data_set_name(copy, data->file_name);
+		request_set_data(rq, copy);
+		if (!request_loadfile(rq, 0)) {
+			/* the error response is ready */
+			return;
+		}
+		data = rq->data;
 	}
+
 	/* do some processing */
 	request_processfile(rq);
-	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
-	size += sprintf(buf + size, "Server: OS Web Server\r\n");
-	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
-
-	Rio_write(rq->fd, buf, strlen(buf));
 
-	/* writes data->file_buf to the client socket */
+	/* request_write sends the header and data->file_buf to the client
+	 * socket with a single system call, when the socket takes it all */
+	request_queue_header(rq, data->header, data->header_size);
 	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+		rq->iov[rq->iovcnt].iov_base = data->file_buf;
+		rq->iov[rq->iovcnt].iov_len = data->file_size;
+		rq->iovcnt++;
 	}
 }
@@ -1,16 +1,61 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+/* names up to this long are stored in the file_data itself */
+#define FILE_NAME_INLINE 64
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	int mapped;	 /* file_buf is an mmap of the file, not a heap copy */
+	struct timespec file_mtime;	/* when the file was modified, as read */
+	/* computed once when the file is read, so that sending a cached file
+	 * does no work that depends on its contents */
+	unsigned int file_csum;	/* checksum of file_buf */
+	char *header;	 /* response header sent before the file */
+	int header_size;
+	_Atomic int refcnt; /* file is freed when the last reference is put */
+	char file_name_buf[FILE_NAME_INLINE];
+};
+
+/* file_data_init returns a file with one reference held by the caller */
+struct file_data *file_data_init(void);
+/* sets the file's name to a copy of name */
+void file_data_set_name(struct file_data *data, char *name);
+void file_data_get(struct file_data *data);
+void file_data_put(struct file_data *data);
+/* bytes of memory that the file's contents take up */
+int file_data_mem_size(struct file_data *data);
+
+/* results of request_read and request_write */
+enum {
+	REQUEST_DONE,
+	REQUEST_AGAIN,	/* the socket would block, try again when it's ready */
+	REQUEST_FAILED,	/* bad request, write the error response */
+	REQUEST_CLOSED,	/* the connection is gone, destroy the request */
 };
 
 struct request *request_init(int connfd, struct file_data *data);
+int request_read(struct request *rq);
 int request_readfile(struct request *rq);
+void request_readfile_async(struct request *rq,
+			    void (*done)(void *arg, int ret), void *arg);
+struct file_data *request_preloadfile(char *file_name, int map);
+struct file_data *request_restorefile(char *file_name, int size,
+				     struct timespec mtime, unsigned int csum,
+				     int map);
+void request_loader_start(int uring, int nr_threads);
+void request_loader_stop(void);
+int request_mapfile(struct request *rq);
 void request_set_data(struct request *rq, struct file_data *data);
 void request_sendfile(struct request *rq);
+int request_sendfile_direct(struct request *rq, unsigned int csum, int size,
+			    struct timespec mtime);
+int request_write(struct request *rq);
+int request_keepalive(struct request *rq);
+void request_next(struct request *rq, struct file_data *data);
+int request_pending(struct request *rq);
 void request_destroy(struct request *rq);
 
 #endif
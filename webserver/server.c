@@ -2,22 +2,83 @@
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "cache.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [-p policy] [-m max_file_size] [-w size_weight] [-M] [-i index]
+ *         [-R] [-n min_threads] [-I idle_timeout] [-S threads]
+ *         [-A loader] [-W manifest] [-B rate] [-C snapshot]
+ *         [-T conn_timeout] portnum
+ *         nr_threads max_requests max_cache_size
+ *
+ * Options:
+ *  -p policy		cache replacement policy: lru (default), clock, arc,
+ *			tinylfu or gdsf
+ *  -m max_file_size	files larger than this are never cached (default: no
+ *			limit)
+ *  -w size_weight	how much gdsf favors small files, from 0 (best byte hit
+ *			ratio) to 1 (best request hit ratio, default)
+ *  -M			cache files as read-only mmaps instead of copies in
+ *			the heap. the cached pages are shared with the page
+ *			cache and other processes, and mapped files are
+ *			charged to the cache in whole pages
+ *  -i index		index of the checksums of the files, as written by the
+ *			fileset program. files that are not cached and are in
+ *			the index are sent with sendfile(2), without copying
+ *			them through the server
+ *  -R			each worker thread listens on the port with a
+ *			SO_REUSEPORT socket of its own, pinned to a CPU, and
+ *			serves the connections that it accepts. there is no
+ *			request queue, max_requests is ignored
+ *  -n min_threads	start with min_threads worker threads, and add more,
+ *			up to nr_threads, while the requests queue up. the
+ *			workers above min_threads exit when they are idle
+ *  -I idle_timeout	milliseconds that a worker above min_threads waits for
+ *			a request before it exits (default: 1000)
+ *  -S threads		handle requests in a staged pipeline instead of worker
+ *			threads. threads is the number of threads of the
+ *			parse, fetch, process and send stages, separated by
+ *			commas, e.g., 1,8,2,1. each stage queues up to
+ *			max_requests connections, nr_threads is ignored
+ *  -A loader		read files asynchronously, with uring (io_uring, or
+ *			threads if the kernel has no io_uring) or threads (a
+ *			pool of threads). with -S, the fetch stage serves
+ *			other connections while the files are read
+ *  -W manifest		warm up the cache with the files listed in manifest,
+ *			hottest first, while serving requests. manifest is
+ *			an index written by the fileset program, or a list of
+ *			file names, one per line
+ *  -B rate		the most bandwidth that warming up the cache takes, in
+ *			KB/s, 0 for no limit (default: 2048)
+ *  -C snapshot		write a snapshot of the cache to this file at exit,
+ *			and warm up the cache from it at startup if there is
+ *			no -W. files that changed since are not restored, and
+ *			with -M, the files are mapped without reading them
+ *  -T conn_timeout	milliseconds that a connection may wait for its
+ *			client, e.g., for the next request on a persistent
+ *			connection, before it is closed, 0 to keep waiting
+ *			(default: 5000)
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
- * is done within routines written in server_thread.c and request.c
+ * is done within routines written in server_thread.c and request.c. The
+ * connections are multiplexed with epoll, so there may be many more of them
+ * than worker threads. Worker threads need a request queue: the ready
+ * connections are split over a queue per worker, which hold max_requests in
+ * all, and one each at least.
  */
 
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	fprintf(stderr, "Usage: %s [-p policy] [-m max_file_size] "
+		"[-w size_weight] [-M] [-i index] [-R] [-n min_threads] "
+		"[-I idle_timeout] [-S threads] [-A uring|threads] "
+		"[-W manifest] [-B rate] [-C snapshot] [-T conn_timeout] "
+		"port nr_threads "
+		"max_requests max_cache_size\n", program);
 	exit(1);
 }
 
@@ -56,17 +117,99 @@ int
 main(int argc, char *argv[])
 {
 	int port, nr_threads, max_requests, max_cache_size;
-	int listenfd, connfd, clientlen;
 	int exitfd;
-	struct sockaddr_in clientaddr;
+	int opt;
 	struct server *sv;
+	struct server_options opts = {
+		.cache_policy = "lru",
+		.cache_max_file_size = 0,
+		.cache_size_weight = 1,
+		.cache_mmap = 0,
+		.index_file = NULL,
+		.reuseport = 0,
+		.min_threads = 0,
+		.idle_timeout = 1000,
+		.stage_threads = { 0 },
+		.loader = LOADER_NONE,
+		.warmup_file = NULL,
+		.warmup_rate = 2048,
+		.snapshot_file = NULL,
+		.conn_timeout = 5000,
+	};
 
-	if (argc != 5)
+	while ((opt = getopt(argc, argv, "p:m:w:Mi:Rn:I:S:A:W:B:C:T:")) != -1) {
+		switch (opt) {
+		case 'p':
+			opts.cache_policy = optarg;
+			break;
+		case 'm':
+			opts.cache_max_file_size = atoi(optarg);
+			break;
+		case 'w':
+			opts.cache_size_weight = atof(optarg);
+			break;
+		case 'M':
+			opts.cache_mmap = 1;
+			break;
+		case 'i':
+			opts.index_file = optarg;
+			break;
+		case 'R':
+			opts.reuseport = 1;
+			break;
+		case 'n':
+			opts.min_threads = atoi(optarg);
+			break;
+		case 'I':
+			opts.idle_timeout = atoi(optarg);
+			break;
+		case 'S':
+			if (sscanf(optarg, "%d,%d,%d,%d",
+				   &opts.stage_threads[STAGE_PARSE],
+				   &opts.stage_threads[STAGE_FETCH],
+				   &opts.stage_threads[STAGE_PROCESS],
+				   &opts.stage_threads[STAGE_SEND]) != 4 ||
+			    opts.stage_threads[STAGE_PARSE] <= 0 ||
+			    opts.stage_threads[STAGE_FETCH] <= 0 ||
+			    opts.stage_threads[STAGE_PROCESS] <= 0 ||
+			    opts.stage_threads[STAGE_SEND] <= 0) {
+				fprintf(stderr, "-S needs four thread counts "
+					"> 0\n");
+				usage(argv[0]);
+			}
+			break;
+		case 'A':
+			if (strcmp(optarg, "uring") == 0) {
+				opts.loader = LOADER_URING;
+			} else if (strcmp(optarg, "threads") == 0) {
+				opts.loader = LOADER_THREADS;
+			} else {
+				fprintf(stderr, "unknown loader %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'W':
+			opts.warmup_file = optarg;
+			break;
+		case 'B':
+			opts.warmup_rate = atoi(optarg);
+			break;
+		case 'C':
+			opts.snapshot_file = optarg;
+			break;
+		case 'T':
+			opts.conn_timeout = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 4)
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	port = atoi(argv[optind]);
+	nr_threads = atoi(argv[optind + 1]);
+	max_requests = atoi(argv[optind + 2]);
+	max_cache_size = atoi(argv[optind + 3]);
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
 		usage(argv[0]);
@@ -75,34 +218,62 @@ main(int argc, char *argv[])
 		fprintf(stderr, "arguments should be > 0\n");
 		usage(argv[0]);
 	}
+	if (opts.cache_max_file_size < 0 || opts.cache_size_weight < 0 ||
+	    opts.cache_size_weight > 1) {
+		fprintf(stderr, "max_file_size should be >= 0 and size_weight "
+			"between 0 and 1\n");
+		usage(argv[0]);
+	}
+	if (opts.reuseport && nr_threads == 0) {
+		fprintf(stderr, "-R needs worker threads\n");
+		usage(argv[0]);
+	}
+	if (nr_threads > 0 && max_requests == 0 && !opts.reuseport) {
+		fprintf(stderr, "worker threads need a request queue, "
+			"max_requests > 0\n");
+		usage(argv[0]);
+	}
+	if (opts.min_threads < 0 || opts.min_threads > nr_threads ||
+	    opts.idle_timeout <= 0) {
+		fprintf(stderr, "min_threads should be between 0 and "
+			"nr_threads, and idle_timeout > 0\n");
+		usage(argv[0]);
+	}
+	if (opts.min_threads > 0 && (opts.reuseport || max_requests == 0)) {
+		fprintf(stderr, "-n needs a request queue, and no -R\n");
+		usage(argv[0]);
+	}
+	if (opts.stage_threads[0] > 0 &&
+	    (opts.reuseport || opts.min_threads > 0 || max_requests == 0)) {
+		fprintf(stderr, "-S needs a request queue, and no -R or -n\n");
+		usage(argv[0]);
+	}
+	if ((opts.warmup_file || opts.snapshot_file) && max_cache_size == 0) {
+		fprintf(stderr, "-W and -C need a cache\n");
+		usage(argv[0]);
+	}
+	if (opts.conn_timeout < 0) {
+		fprintf(stderr, "conn_timeout should be >= 0\n");
+		usage(argv[0]);
+	}
+	if (opts.warmup_rate < 0) {
+		fprintf(stderr, "rate should be >= 0\n");
+		usage(argv[0]);
+	}
+	if (!cache_policy_valid(opts.cache_policy)) {
+		fprintf(stderr, "unknown cache policy %s\n", opts.cache_policy);
+		usage(argv[0]);
+	}
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	/* a client that goes away while its response is being written
+	 * shouldn't kill the server */
+	signal(SIGPIPE, SIG_IGN);
+	sv = server_init(nr_threads, max_requests, max_cache_size, &opts);
 
-	listenfd = open_listenfd(port);
 	exitfd = open_fifo();
 
-	struct pollfd fds[] = {
-		{exitfd, POLLIN},
-		{listenfd, POLLIN},
-	};
-	while (1) {
-		/* wait for either a client to connect or an exit event */
-		SYS(poll(fds, 2, -1));
-		
-		if(fds[0].revents & POLLIN) { /* exit requested */
-			break;
-		}
-
-		assert(fds[1].revents & POLLIN); /* connect request arrived */
-		clientlen = sizeof(clientaddr);
-		/* connfd is the socket descriptor the server will use to send
-		 * data to the client */
-		SYS(connfd = accept(listenfd, (struct sockaddr *)&clientaddr,
-				    (socklen_t *) & clientlen));
-
-		/* serve the request */
-		server_request(sv, connfd);
-	}
+	/* wait for clients to connect, and serve them, until an exit event */
+	server_loop(sv, port, exitfd);
 
 	close_fifo();
 	server_exit(sv);
@@ -1,6 +1,163 @@
+#include "common.h"
 #include "request.h"
 #include "server_thread.h"
-#include "common.h"
+#include "cache.h"
+#include "file_index.h"
+#include "queue.h"
+#include "stage.h"
+#include "warmup.h"
+#include "snapshot.h"
+#include "pool.h"
+
+/*
+ * Connections are multiplexed by an edge-triggered epoll reactor, run by the
+ * main thread in server_loop. Sockets are non-blocking, and a connection is
+ * only handed to a worker when its socket is ready. If the worker can't read
+ * the whole request or write the whole response without blocking, it re-arms
+ * the connection in epoll and moves on, so thousands of connections only need
+ * nr_threads threads. Connections are registered with EPOLLONESHOT, so only
+ * one thread works on a connection at a time. A persistent connection stays
+ * with its worker for as long as requests are waiting on it, and goes back to
+ * epoll once its socket runs dry.
+ *
+ * Each worker has a queue of its own. A ready connection goes back to the
+ * worker that served it last if that worker is idle, where its socket and
+ * buffers are still in the CPU's caches, and otherwise to the worker with the
+ * fewest connections queued or running. A worker whose queue is empty steals
+ * from the queues of the others before it goes to sleep.
+ *
+ * The pool of workers is elastic when min_threads is below nr_threads. Only
+ * min_threads workers are started, and the main thread starts another one,
+ * at most once a tick, when the connections queued per worker stay above a
+ * high-water mark, or when the 99th percentile of the time that connections
+ * wait in the queues gets too long. A worker above min_threads that finds
+ * nothing to do for idle_timeout milliseconds retires.
+ *
+ * With the staged option, there are no workers. The handling of a request is
+ * split into the stages of a pipeline (SEDA): parse, fetch (from the cache or
+ * the disk), process, and send. Each stage has a bounded queue and a pool of
+ * threads of its own, see stage.c, so the threads that wait for the disk don't
+ * hold up the threads that process files. A connection only moves forward
+ * through the stages, and goes back to the parse stage through epoll, so the
+ * stages never wait for each other in a cycle.
+ *
+ * With the reuseport option, there is no central reactor. Each worker is
+ * pinned to a CPU and runs a reactor of its own, with its own SO_REUSEPORT
+ * listening socket. The kernel spreads the connections over the listeners,
+ * and a worker serves the connections that it accepted itself, so they are
+ * never handed over between threads.
+ *
+ * A connection whose client sends nothing and reads nothing for conn_timeout
+ * milliseconds is shut down by its reactor, which looks for such connections
+ * every half timeout. Shutting the socket down wakes the connection up through
+ * epoll like any other event, and whoever runs it next finds that the client
+ * is gone and closes it, so the reactor never frees a connection that another
+ * thread may be about to arm.
+ *
+ * The reactor never waits for a full queue, which would leave its other
+ * connections waiting too. A connection that finds every queue full stays
+ * with the reactor, which hands it over again once it wakes up, a millisecond
+ * later at most. When accept runs out of descriptors or memory, the reactor
+ * accepts the connections that are left once the retry interval is over,
+ * since the edge-triggered listener doesn't report them again.
+ */
+
+struct reactor;
+struct worker;
+
+/* a client connection */
+struct conn {
+	int fd;
+	struct request *rq;
+	struct file_data *data;	/* the requested file, owned by rq */
+	int writing;		/* the request has been read and handled */
+	struct reactor *rx;	/* the reactor that the socket is in */
+	struct worker *worker;	/* the worker that ran it last, or NULL */
+	long queued;		/* when it was queued, with an elastic pool */
+	int loader;		/* it reads the file for the cache */
+	/* when it was handed to epoll, in microseconds, 0 while it runs */
+	atomic_long armed;
+	/* the next in its reactor's backlog, or in the files read for the
+	 * fetch stage */
+	struct conn *deferred;
+	int fetched;		/* the result of server_fetch_done */
+	/* the list of open connections, so that the ones that are left at
+	 * exit can be closed */
+	struct conn *prev, *next;
+};
+
+/* an epoll loop that accepts the connections to listenfd, and waits for
+ * their sockets to be ready */
+struct reactor {
+	struct server *sv;
+	int epfd;
+	int listenfd;
+	int stopfd;		/* the loop returns once this is readable */
+	int cpu;		/* the worker's CPU, with reuseport */
+	pthread_mutex_t conns_lock;
+	struct conn conns;	/* head of the list of open connections */
+	long next_sweep;	/* when idle connections are looked for next */
+	long nr_expired;	/* connections shut down when idle */
+	/* the connections that were ready when the queues were full, in the
+	 * order they got ready */
+	struct conn *backlog, **backlog_tail;
+	long nr_deferred;	/* connections added to the backlog */
+	long accept_retry;	/* when accept is tried again, or 0 */
+};
+
+/* the states of a worker */
+enum {
+	WORKER_STOPPED,		/* there is no thread */
+	WORKER_RUNNING,		/* connections are queued for it */
+	WORKER_RETIRING,	/* it serves the connections left in its queue */
+	WORKER_RETIRED,		/* the thread has exited */
+};
+
+/* the time that connections waited in a queue is counted in buckets of
+ * powers of two microseconds */
+#define NR_WAIT_BUCKETS 32
+
+/* a worker thread, and the connections queued for it */
+struct worker {
+	struct server *sv;
+	struct queue *queue;
+	atomic_int state;
+	/* a connection is being served, only written by the worker */
+	atomic_int busy;
+	/* the waits of the connections it served, with an elastic pool */
+	atomic_long waits[NR_WAIT_BUCKETS];
+	/* statistics, read once the worker has exited */
+	/* a connection is run each time its socket is ready, which is
+	 * several times for a slow client or a keep-alive connection */
+	long nr_runs;		/* connections run, including stolen ones */
+	long nr_stolen;		/* connections taken from other queues */
+	int max_depth;		/* longest queue, updated by the main thread */
+};
+
+#define MAX_EVENTS 64
+
+/* how long the reactor waits to hand over its backlog again, in
+ * milliseconds, and to accept again when it was out of descriptors, in
+ * microseconds */
+#define BACKLOG_RETRY_MS 1
+#define ACCEPT_RETRY_US 100000
+
+/* the threads that read the files when the loader has no io_uring. each one
+ * waits for the disk, so there are as many as the reads in flight. */
+#define LOADER_THREADS_MAX 16
+
+/* the threads that warm up the cache */
+#define WARMUP_THREADS 4
+
+/* an elastic pool grows by a worker a tick at most, when there were
+ * POOL_HIGH_WATER connections queued per running worker at two ticks in a
+ * row, or when the 99th percentile of the waits since the last tick reached
+ * POOL_MAX_WAIT_US. a percentile needs POOL_MIN_WAITS waits, fewer are
+ * carried over to the next tick. */
+#define POOL_TICK_US 10000
+#define POOL_HIGH_WATER 2
+#define POOL_MAX_WAIT_US 2000
+#define POOL_MIN_WAITS 16
 
 struct server {
 	int nr_threads;
@@ -9,301 +166,480 @@ struct server {
 	int exiting;
 	/* add any other parameters you need */
 	pthread_t *worker_thread_list;
+	struct cache *cache;
+	int cache_mmap;
+	struct file_index *index;
+	int reuseport;
+	/* the reactor run by the main thread, or one per worker with
+	 * reuseport */
+	struct reactor *reactors;
+	int nr_reactors;
+	int stopfd;		/* eventfd that stops the workers' reactors */
+	/* the workers that ready connections are queued for, NULL with
+	 * reuseport or no worker threads */
+	struct worker *workers;
+	int next_worker;	/* where the search for an idle worker starts */
+	/* the elastic pool, min_threads is nr_threads when the pool is
+	 * fixed. the other fields are only used by the main thread, except
+	 * for the counts of the workers. */
+	int min_threads;
+	int idle_timeout;	/* in milliseconds */
+	atomic_int nr_running;	/* workers that connections are queued for */
+	long next_tick;		/* when the pool may grow next */
+	int nr_high_ticks;	/* ticks in a row above the high-water mark */
+	long waits[NR_WAIT_BUCKETS];	/* the waits counted at the last tick */
+	int nr_started;
+	atomic_int nr_retired;
+	int max_running;
+	/* the stages of the staged pipeline, NULL without it */
+	struct stage *stages[NR_STAGES];
+	/* the connections whose files the loader has read, which the fetch
+	 * stage hands on, since the loader must not wait for a full queue */
+	pthread_mutex_t fetched_lock;
+	struct conn *fetched;
+	int fetched_closed;	/* the fetch stage takes no more items */
+	struct warmup *warmup;	/* NULL if the cache isn't warmed up */
+	char *snapshot_file;	/* written at exit, NULL for none */
+	struct pool *conn_pool;	/* the connections are allocated from it */
+	int conn_timeout;	/* in milliseconds, 0 for none */
 };
 
 /* static functions */
-int *buffer;
-int in;
-int out;
-pthread_mutex_t buffer_lock;
-pthread_mutex_t cache_lock;
-pthread_cond_t cv_full;
-pthread_cond_t cv_empty;
-
-/* new data structure */
-struct node{
-	struct file_data *data;
-	struct node *next;
-};
 
-struct master{
-	int table_size;
-	struct node **hash_table;
-	struct node *LRU;
-};
+static long server_time_us(void);
+
+static int server_fetch_done(struct server *sv, struct file_data *data,
+			     int loader, int ret);
 
-/* hash key function */
-/* djb2 hash function found on http://www.cse.yorku.ca/~oz/hash.html#:~:text=If%20you%20just%20want%20to,K%26R%5B1%5D%2C%20etc. 
-   Made small adjustment */
-unsigned long hash(char *str, long table_size)
+/* finds the requested file in the cache for a request that has been read.
+ * data is the requested file, owned by rq. returns 1 if the file is ready to
+ * be sent with request_sendfile, or 0 if the response is ready already: an
+ * error, or a file that is sent straight from the kernel. returns -1 if the
+ * file must be read with request_readfile, and the result passed to
+ * server_fetch_done along with loader. */
+static int
+server_fetch_start(struct server *sv, struct request *rq,
+		   struct file_data *data, int *loader)
 {
-	unsigned long hash = 5381;
-	int c;
+	struct file_data *target;
+	int ret, size;
+	unsigned int csum;
+	struct timespec mtime;
 
-	while ((c = *str++)){
-		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	/* files that won't be cached are sent straight from the kernel if we
+	 * know their checksum. if the file changed since the index was made,
+	 * it is read as usual. */
+	if (sv -> index && file_index_lookup(sv -> index, data -> file_name,
+					     &csum, &size, &mtime) &&
+	    (!sv -> cache || size > cache_max_file_size(sv -> cache))) {
+		ret = request_sendfile_direct(rq, csum, size, mtime);
+		if (ret >= 0) {
+			return 0;
+		}
 	}
 
-	return hash % table_size;
+	*loader = 0;
+	if(sv -> max_cache_size == 0){
+	   /* read file, 
+		* fills data->file_buf with the file contents,
+		* data->file_size with file size. */
+		return -1;
+	}
+	/* the hit comes back pinned, so it can't be freed by an eviction
+	 * while we are sending it. if another worker is already reading the
+	 * file, this waits for its result. */
+	target = cache_lookup_load(sv->cache, data->file_name, loader);
+	if (target){
+		/* cache hit, the request takes over our pin and drops data */
+		request_set_data(rq, target);
+		return 1;
+	}
+	/* cache miss. mapping a file doesn't wait for the disk, so it is
+	 * done here. */
+	if (sv -> cache_mmap) {
+		return server_fetch_done(sv, data, *loader,
+					 request_mapfile(rq));
+	}
+	return -1;
 }
 
-/* global variables */
-int maximum_cache_size;
-int available_cache_size;
-struct master *master_table;
+/* finishes server_fetch_start once the file has been read, with ret the
+ * result of reading it. returns 1 if the file is ready to be sent, or 0 if
+ * the error response is ready. */
+static int
+server_fetch_done(struct server *sv, struct file_data *data, int loader,
+		  int ret)
+{
+	if (sv -> max_cache_size == 0) {
+		return ret;
+	}
+	/* put the new data into cache and wake up the workers waiting for it,
+	 * the request keeps its own reference until it is sent */
+	if (loader){
+		cache_load_done(sv->cache, data->file_name, ret ? data : NULL);
+	}else if (ret){
+		cache_insert(sv->cache, data);
+	}
+	return ret;
+}
 
-/* initialize file data */
-static struct file_data *
-file_data_init(void)
+/* finds the requested file in the cache, or reads it, for a request that has
+ * been read. data is the requested file, owned by rq. returns 1 if the file is
+ * ready to be sent with request_sendfile, or 0 if the response is ready
+ * already. */
+static int
+server_fetch(struct server *sv, struct request *rq, struct file_data *data)
 {
-	struct file_data *data;
+	int loader, ret;
 
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
-	data->file_buf = NULL;
-	data->file_size = 0;
-	return data;
+	ret = server_fetch_start(sv, rq, data, &loader);
+	if (ret < 0) {
+		ret = server_fetch_done(sv, data, loader,
+					request_readfile(rq));
+	}
+	return ret;
 }
 
-/* free all file data */
+/* prepares the response for a request that has been read. data is the
+ * requested file, owned by rq. */
 static void
-file_data_free(struct file_data *data)
-{
-	free(data->file_name);
-	free(data->file_buf);
-	free(data);
-}
-
-/* Lab 5 related functions */
-/* when encounter cache hit, the file need to be put to the end of LRU list */
-void update_LRU(struct file_data *file){
-	/* move existing LRU to the back of the list */
-	struct node *target = NULL;
-	struct node *temp = master_table -> LRU;
-	if (strcmp(temp -> data -> file_name, file -> file_name) == 0){
-		target = temp;
-		master_table -> LRU = temp -> next;
-		temp = master_table -> LRU;
-		target -> next = NULL;
-		if (temp == NULL){
-			/* only one node */
-			master_table -> LRU = target;
-			return;
-		}else{
-			while (temp -> next != NULL){
-				temp = temp -> next;
+do_server_request(struct server *sv, struct request *rq,
+		  struct file_data *data)
+{
+	if (server_fetch(sv, rq, data)) {
+		/* send file to client */
+		request_sendfile(rq);
+	}
+}
+
+static void
+conn_close(struct conn *conn)
+{
+	struct reactor *rx = conn->rx;
+
+	pthread_mutex_lock(&rx->conns_lock);
+	conn->prev->next = conn->next;
+	conn->next->prev = conn->prev;
+	pthread_mutex_unlock(&rx->conns_lock);
+	/* closing the socket also removes it from epoll */
+	request_destroy(conn->rq);
+	pool_free(rx->sv->conn_pool, conn);
+}
+
+/* waits for the connection's socket to be ready for events again */
+static void
+conn_arm(struct conn *conn, int events)
+{
+	struct epoll_event ev;
+
+	ev.events = events | EPOLLET | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	atomic_store(&conn->armed, server_time_us());
+	SYS(epoll_ctl(conn->rx->epfd, EPOLL_CTL_MOD, conn->fd, &ev));
+}
+
+/* makes progress on a connection whose socket is ready. this runs until the
+ * socket would block, and then hands the connection back to epoll. */
+static void
+conn_run(struct server *sv, struct conn *conn)
+{
+	int ret;
+
+	while (1) {
+		if (!conn->writing) {
+			/* fill data->file_name with name of the file being
+			 * requested */
+			ret = request_read(conn->rq);
+			if (ret == REQUEST_AGAIN) {
+				conn_arm(conn, EPOLLIN);
+				return;
 			}
-			temp -> next = target;
-			return;
-		}
-	}else{
-		while (temp -> next != NULL){
-			if (strcmp(temp -> next -> data -> file_name, file -> file_name) == 0){
-				target = temp -> next;
-				temp -> next = temp -> next -> next;
-        target -> next = NULL;
-				break;
+			if (ret == REQUEST_CLOSED) {
+				conn_close(conn);
+				return;
+			}
+			if (ret == REQUEST_DONE) {
+				do_server_request(sv, conn->rq, conn->data);
 			}
-      temp = temp->next;
+			/* else, the error response is sent */
+			conn->writing = 1;
+		}
+		ret = request_write(conn->rq);
+		if (ret == REQUEST_AGAIN) {
+			conn_arm(conn, EPOLLOUT);
+			return;
 		}
-		while (temp -> next != NULL){
-			temp = temp -> next;
+		if (ret != REQUEST_DONE || !request_keepalive(conn->rq)) {
+			conn_close(conn);
+			return;
 		}
-		temp -> next = target;
+		/* a persistent connection, go on with the next request. it
+		 * may have been pipelined behind this one. */
+		conn->data = file_data_init();
+		request_next(conn->rq, conn->data);
+		conn->writing = 0;
 	}
 }
 
+/* the stages of the staged pipeline. a stage hands a connection on to the
+ * next one, or waits for its socket to be ready. */
 
-void push_LRU(struct file_data *file){
-	if (master_table -> LRU == NULL){
-		struct node *new = (struct node *)malloc(sizeof(struct node));
-		new -> data = file;
-		new -> next = NULL;
-		master_table -> LRU = new;
+static void
+stage_parse(void *arg, void *item)
+{
+	struct server *sv = arg;
+	struct conn *conn = item;
+	int ret;
+
+	ret = request_read(conn->rq);
+	if (ret == REQUEST_AGAIN) {
+		conn_arm(conn, EPOLLIN);
 		return;
-	}else{
-		struct node *temp = master_table -> LRU;
-		while (temp -> next != NULL){
-			temp = temp -> next;
-		}
-		struct node *new = (struct node *)malloc(sizeof(struct node));
-		new -> data = file;
-		new -> next = NULL;
-		temp -> next = new;
-	}
-}
-
-/* cache lookup */
-struct file_data *cache_lookup(struct file_data *file){
-	unsigned long key = hash(file -> file_name, master_table -> table_size);
-	if (master_table -> hash_table[key] == NULL){
-		return NULL; /* cache miss */
-	}else{
-		struct node* temp = master_table -> hash_table[key]; /* points to the head of the list */
-		while (temp != NULL){
-			if (strcmp(file -> file_name, temp -> data -> file_name) == 0){
-				update_LRU(file);	
-				return temp -> data;
-			}
-			temp = temp -> next;
-		}
 	}
-	return NULL;
+	if (ret == REQUEST_CLOSED) {
+		conn_close(conn);
+		return;
+	}
+	conn->writing = 1;
+	/* an error response is sent as it is */
+	stage_push(sv->stages[ret == REQUEST_DONE ? STAGE_FETCH : STAGE_SEND],
+		   conn);
 }
 
-/* cache evict */
-void cache_evict(int required_size){
-	while (available_cache_size < required_size){
-		struct node *popped = master_table -> LRU;
-		master_table -> LRU = popped -> next;
-		popped -> next = NULL;
-		available_cache_size += popped -> data -> file_size;
-		/* get the node out of the hash table too */
-		unsigned long key = hash(popped -> data -> file_name, master_table -> table_size);
-		struct node* temp = master_table -> hash_table[key]; /* points to the head of the list */
-		if (strcmp(temp -> data -> file_name, popped -> data -> file_name) == 0){
-			/* head of the list */
-			master_table -> hash_table[key] = temp -> next;
-			free(temp);
-			free(popped);
-		}else{
-			while (temp -> next != NULL){
-				if (strcmp(temp -> next -> data -> file_name, popped -> data -> file_name) == 0){
-					struct node *delete_node = temp -> next;
-					temp -> next = delete_node -> next;
-					delete_node -> next = NULL;
-					break;
-				}
-				temp = temp -> next;
-			}
-			free(temp);
-			free(popped);
-		}
+/* hands a connection on from the fetch stage, with ret the result of
+ * server_fetch */
+static void
+stage_fetched(struct server *sv, struct conn *conn, int ret)
+{
+	stage_push(sv->stages[ret ? STAGE_PROCESS : STAGE_SEND], conn);
+}
+
+/* hands on the connections whose files the loader has read. a thread of the
+ * fetch stage does this, or the main thread once the stage has stopped. */
+static void
+stage_fetched_all(struct server *sv)
+{
+	struct conn *conn, *next;
+
+	pthread_mutex_lock(&sv->fetched_lock);
+	conn = sv->fetched;
+	sv->fetched = NULL;
+	pthread_mutex_unlock(&sv->fetched_lock);
+	for (; conn; conn = next) {
+		next = conn->deferred;
+		stage_fetched(sv, conn, conn->fetched);
 	}
 }
 
+/* a file has been read for the fetch stage, called by the loader. the file
+ * goes into the cache right away, since fetch threads may be waiting for it.
+ * the loader's thread may not wait for a full queue though, so the
+ * connection is left for the fetch stage, and &sv->fetched is pushed to the
+ * stage to wake up one of its threads. if the queue is full, a thread will
+ * find the connection when it takes the next item. */
+static void
+stage_fetch_done(void *arg, int ret)
+{
+	struct conn *conn = arg;
+	struct server *sv = conn->rx->sv;
 
-/* cache insert */
-void cache_insert(struct file_data *file){
-	if (file -> file_size > maximum_cache_size){
+	conn->fetched = server_fetch_done(sv, conn->data, conn->loader, ret);
+	pthread_mutex_lock(&sv->fetched_lock);
+	conn->deferred = sv->fetched;
+	sv->fetched = conn;
+	/* the threads that found the list empty pushed the item already */
+	if (conn->deferred == NULL && !sv->fetched_closed) {
+		stage_try_push(sv->stages[STAGE_FETCH], &sv->fetched);
+	}
+	pthread_mutex_unlock(&sv->fetched_lock);
+}
+
+static void
+stage_fetch(void *arg, void *item)
+{
+	struct server *sv = arg;
+	struct conn *conn = item;
+	int ret;
+
+	stage_fetched_all(sv);
+	if (item == &sv->fetched) {
 		return;
 	}
-	struct file_data *target = NULL;
-	target = cache_lookup(file);
-	if (target != NULL){
-		return;  /* other thread put the target into cache already */
-	}else{
-		if (file -> file_size > available_cache_size){
-			cache_evict(file -> file_size);
-		}
-		unsigned long key = hash(file -> file_name, master_table -> table_size);
-		if (master_table -> hash_table[key] == NULL){
-			struct node *new = (struct node *)malloc(sizeof(struct node));
-			new -> data = file;
-			new -> next = NULL;
-			master_table -> hash_table[key] = new;
-			available_cache_size = available_cache_size - file -> file_size;
-		}else{
-			struct node* temp = master_table -> hash_table[key]; /* points to the head of the list */
-			struct node* prev = NULL;
-			while (temp != NULL){
-				prev = temp;
-				temp = temp -> next;
-			}
-			struct node *new = (struct node *)malloc(sizeof(struct node));
-			new -> data = file;
-			new -> next = NULL;
-			prev -> next = new;
-			available_cache_size = available_cache_size - file -> file_size;
-		}
-		push_LRU(file);
+	ret = server_fetch_start(sv, conn->rq, conn->data, &conn->loader);
+	if (ret < 0) {
+		/* with a loader, the fetch thread goes on to the next
+		 * connection while the file is read */
+		request_readfile_async(conn->rq, stage_fetch_done, conn);
+		return;
 	}
+	stage_fetched(sv, conn, ret);
 }
 
+static void
+stage_process(void *arg, void *item)
+{
+	struct server *sv = arg;
+	struct conn *conn = item;
+
+	request_sendfile(conn->rq);
+	stage_push(sv->stages[STAGE_SEND], conn);
+}
 
 static void
-do_server_request(struct server *sv, int connfd)
+stage_send(void *arg, void *item)
 {
+	struct conn *conn = item;
 	int ret;
-	struct request *rq;
-	struct file_data *data;
-
-	data = file_data_init();
 
-	/* fill data->file_name with name of the file being requested */
-	rq = request_init(connfd, data);
-	if (!rq) {
-		file_data_free(data);
+	ret = request_write(conn->rq);
+	if (ret == REQUEST_AGAIN) {
+		conn_arm(conn, EPOLLOUT);
 		return;
 	}
+	if (ret != REQUEST_DONE || !request_keepalive(conn->rq)) {
+		conn_close(conn);
+		return;
+	}
+	conn->data = file_data_init();
+	request_next(conn->rq, conn->data);
+	conn->writing = 0;
+	/* a request that was pipelined behind this one has been read already.
+	 * the socket is writable, so epoll hands the connection back to the
+	 * parse stage at once. */
+	conn_arm(conn, request_pending(conn->rq) ? EPOLLOUT : EPOLLIN);
+}
 
-	if(sv -> max_cache_size == 0){
-	   /* read file, 
-		* fills data->file_buf with the file contents,
-		* data->file_size with file size. */
-		ret = request_readfile(rq);
-		if (ret == 0) { /* couldn't read file */
-			goto out;
+static char *stage_names[NR_STAGES] = { "parse", "fetch", "process", "send" };
+static void (*stage_handlers[NR_STAGES])(void *, void *) = {
+	stage_parse, stage_fetch, stage_process, stage_send,
+};
+
+/* takes a connection from the queue of another worker */
+static struct conn *
+worker_steal(struct worker *w)
+{
+	struct server *sv = w->sv;
+	struct conn *conn;
+	int i, victim = w - sv->workers;
+
+	for (i = 1; i < sv->nr_threads; i++) {
+		victim = (victim + 1) % sv->nr_threads;
+		if (queue_depth(sv->workers[victim].queue) == 0) {
+			continue;
 		}
-		/* send file to client */
-		request_sendfile(rq);
-		request_destroy(rq);
-		return;
-	}else{
-		struct file_data *target = NULL;
-		if (sv -> max_cache_size > 0){
-			pthread_mutex_lock(&cache_lock);
-			target = cache_lookup(data);
-			pthread_mutex_unlock(&cache_lock);
-		}
-		if (target){
-			/* cache hit */
-			request_set_data(rq, target);
-			/* send file to client */
-			request_sendfile(rq);
-		}else{
-			/* cache miss */
-			ret = request_readfile(rq);
-			if (ret == 0) { /* couldn't read file */
-				goto out;
-			}
-			/* send file to client */
-			request_sendfile(rq);
-			/* put the new data into cache */
-			pthread_mutex_lock(&cache_lock);
-			cache_insert(data);
-			pthread_mutex_unlock(&cache_lock);	
+		if ((conn = queue_try_pop(sv->workers[victim].queue)) != NULL) {
+			w->nr_stolen++;
+			return conn;
+		}
+	}
+	return NULL;
+}
+
+/* monotonic time in microseconds */
+static long
+server_time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+static void
+worker_serve(struct worker *w, struct conn *conn)
+{
+	if (w->sv->min_threads < w->sv->nr_threads) {
+		long wait = server_time_us() - conn->queued;
+		int b;
+
+		for (b = 0; wait > 1 && b < NR_WAIT_BUCKETS - 1; b++) {
+			wait >>= 1;
 		}
+		atomic_fetch_add_explicit(&w->waits[b], 1,
+					  memory_order_relaxed);
 	}
-	
-out:
-	request_destroy(rq);
+	atomic_store_explicit(&w->busy, 1, memory_order_relaxed);
+	conn->worker = w;
+	conn_run(w->sv, conn);
+	atomic_store_explicit(&w->busy, 0, memory_order_relaxed);
+	w->nr_runs++;
+}
+
+/* retires an idle worker, unless the pool is down to min_threads. returns 1
+ * if the worker retired, and its thread should exit. */
+static int
+worker_retire(struct worker *w)
+{
+	struct server *sv = w->sv;
+	struct conn *conn;
+	int n = atomic_load(&sv->nr_running);
+
+	do {
+		if (n <= sv->min_threads) {
+			return 0;
+		}
+	} while (!atomic_compare_exchange_weak(&sv->nr_running, &n, n - 1));
+	atomic_store(&w->state, WORKER_RETIRING);
+	/* pairs with the fence in server_request. either the main thread sees
+	 * that we retire, or we see the connection that it queued for us. */
+	atomic_thread_fence(memory_order_seq_cst);
+	while ((conn = queue_try_pop(w->queue)) != NULL) {
+		worker_serve(w, conn);
+	}
+	atomic_fetch_add(&sv->nr_retired, 1);
+	atomic_store(&w->state, WORKER_RETIRED);
+	return 1;
 }
 
 /* entry point functions */
-void stub_function(struct server *sv){
+void stub_function(struct worker *w){
+	struct server *sv = w -> sv;
+	struct conn *conn;
+
 	while (1){
-		//using the notation of the code in F2-monitors slide 7 of producer-consumer with monitors
-		pthread_mutex_lock(&buffer_lock);
-		while (in == out){
-			if (sv -> exiting){
-				pthread_mutex_unlock(&buffer_lock);
-				pthread_exit(0);
-				return;
+		/* our own queue first, then the others, and then sleep until
+		 * something is queued for us. the queues are closed when the
+		 * server exits. */
+		if ((conn = queue_try_pop(w -> queue)) == NULL &&
+		    (conn = worker_steal(w)) == NULL){
+			if (sv -> min_threads == sv -> nr_threads){
+				conn = queue_pop(w -> queue);
+			} else if ((conn = queue_pop_timeout(w -> queue,
+							     sv -> idle_timeout)) == NULL &&
+				   !queue_closed(w -> queue)){
+				/* idle for idle_timeout */
+				if (worker_retire(w)){
+					break;
+				}
+				continue;
+			}
+			if (conn == NULL){
+				break;
 			}
-			pthread_cond_wait(&cv_empty, &buffer_lock);
-		} //empty
+		}
+		worker_serve(w, conn);
+	}
+}
 
-		int connfd = buffer[out];
-		out = (out + 1) % (sv -> max_requests + 1);
-		pthread_cond_broadcast(&cv_full);
-		pthread_mutex_unlock(&buffer_lock);
-		do_server_request(sv, connfd);
+/* starts the thread of worker i, only called by the main thread */
+static void
+worker_start(struct server *sv, int i)
+{
+	int n;
+
+	atomic_store(&sv->workers[i].state, WORKER_RUNNING);
+	n = atomic_fetch_add(&sv->nr_running, 1) + 1;
+	if (n > sv->max_running) {
+		sv->max_running = n;
 	}
+	sv->nr_started++;
+	pthread_create(&sv->worker_thread_list[i], NULL,
+		       (void *)&stub_function, &sv->workers[i]);
 }
 
 struct server *
-server_init(int nr_threads, int max_requests, int max_cache_size)
+server_init(int nr_threads, int max_requests, int max_cache_size,
+	    struct server_options *opts)
 {
 	struct server *sv;
 
@@ -312,64 +648,611 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	sv->max_requests = max_requests;
 	sv->max_cache_size = max_cache_size;
 	sv->exiting = 0;
+	sv->worker_thread_list = NULL;
+	sv->cache = NULL;
+	sv->cache_mmap = opts->cache_mmap;
+	sv->index = NULL;
+	sv->reuseport = opts->reuseport;
+	sv->reactors = NULL;
+	sv->nr_reactors = 0;
+	sv->min_threads = nr_threads;
+	sv->idle_timeout = opts->idle_timeout;
+	atomic_init(&sv->nr_running, 0);
+	sv->next_tick = 0;
+	sv->nr_high_ticks = 0;
+	memset(sv->waits, 0, sizeof(sv->waits));
+	sv->nr_started = 0;
+	atomic_init(&sv->nr_retired, 0);
+	sv->max_running = 0;
+	memset(sv->stages, 0, sizeof(sv->stages));
+	pthread_mutex_init(&sv->fetched_lock, NULL);
+	sv->fetched = NULL;
+	sv->fetched_closed = 0;
+	sv->warmup = NULL;
+	sv->snapshot_file = opts->snapshot_file;
+	sv->conn_pool = pool_init("conn", sizeof(struct conn));
+	sv->conn_timeout = opts->conn_timeout;
+	if (opts->loader != LOADER_NONE) {
+		request_loader_start(opts->loader == LOADER_URING,
+				     LOADER_THREADS_MAX);
+	}
+	if (opts->index_file) {
+		sv->index = file_index_load(opts->index_file);
+		if (sv->index == NULL) {
+			fprintf(stderr, "could not read index %s\n",
+				opts->index_file);
+			exit(1);
+		}
+	}
 
-	//added for Lab4
-	in = 0;
-	out = 0;
-	pthread_mutex_init(&buffer_lock, NULL);
-	pthread_mutex_init(&cache_lock, NULL);
-	pthread_cond_init(&cv_full, NULL);
-	pthread_cond_init(&cv_empty, NULL);
-	
+	sv->workers = NULL;
+	sv->next_worker = 0;
 	if (nr_threads > 0 || max_requests > 0 || max_cache_size > 0) {
-		/* Lab 4: create queue of max_request size when max_requests > 0 */
-		if (max_requests > 0){
-			//to distinguish between empty and full add 1 to max_requests
-			buffer = Malloc(sizeof(int) * (max_requests + 1));
-		}else{
-			buffer = NULL;
+		/* the staged pipeline replaces the workers */
+		if (opts -> stage_threads[0] > 0){
+			nr_threads = sv -> nr_threads = sv -> min_threads = 0;
+		}
+		/* Lab 4: create queue of max_request size when max_requests > 0.
+		 * the requests are split over the queues of the workers, which
+		 * hold max_requests in all, but one each at least. */
+		if (max_requests > 0 && nr_threads > 0 && !sv -> reuseport){
+			sv -> workers = Malloc(sizeof(struct worker) * nr_threads);
+			for (int i = 0; i < nr_threads; i++){
+				struct worker *w = &sv -> workers[i];
+				int size = max_requests / nr_threads +
+					(i < max_requests % nr_threads);
+
+				w -> sv = sv;
+				w -> queue = queue_init(size > 0 ? size : 1);
+				atomic_init(&w -> state, WORKER_STOPPED);
+				atomic_init(&w -> busy, 0);
+				for (int b = 0; b < NR_WAIT_BUCKETS; b++){
+					atomic_init(&w -> waits[b], 0);
+				}
+				w -> nr_runs = 0;
+				w -> nr_stolen = 0;
+				w -> max_depth = 0;
+			}
+		}
+		/* an elastic pool starts with min_threads workers */
+		if (sv -> workers && opts -> min_threads > 0 &&
+		    opts -> min_threads < nr_threads){
+			sv -> min_threads = opts -> min_threads;
 		}
-		/* Lab 4: create worker threads when nr_threads > 0 */
+		/* Lab 4: create worker threads when nr_threads > 0. with
+		 * reuseport, server_loop creates them with their listeners. */
 		if (nr_threads > 0){
 			sv -> worker_thread_list = Malloc(sizeof(pthread_t) * nr_threads);
-			for (int i = 0; i < nr_threads; i++){
-				pthread_create(&sv -> worker_thread_list[i], NULL, (void *)&stub_function, sv);
+			for (int i = 0; i < sv -> min_threads && !sv -> reuseport; i++){
+				worker_start(sv, i);
 			}
 		}
 		/* Lab 5: init server cache and limit its size to max_cache_size */
 		if (max_cache_size > 0){
-			maximum_cache_size = max_cache_size;
-			available_cache_size = max_cache_size;
-			master_table = malloc(sizeof(struct master));
-			master_table -> table_size = 100000;
-			master_table -> hash_table = malloc(sizeof(struct node*) * 100000);
-			master_table -> LRU = NULL;
-			for (int i = 0; i < 100000; i++){
-				master_table -> hash_table[i] = NULL;
+			struct cache_config config = {
+				.policy = opts -> cache_policy,
+				.max_file_size = opts -> cache_max_file_size,
+				.size_weight = opts -> cache_size_weight,
+			};
+			sv -> cache = cache_init(max_cache_size, &config);
+		}
+		/* the cache is warmed up while the server is serving
+		 * requests. there is no snapshot yet on the first run. */
+		if (sv -> cache && !opts -> warmup_file &&
+		    opts -> snapshot_file){
+			sv -> warmup = warmup_start(sv -> cache,
+						    opts -> snapshot_file,
+						    sv -> cache_mmap,
+						    WARMUP_THREADS,
+						    opts -> warmup_rate,
+						    max_cache_size);
+		}
+		if (sv -> cache && opts -> warmup_file){
+			sv -> warmup = warmup_start(sv -> cache,
+						    opts -> warmup_file,
+						    sv -> cache_mmap,
+						    WARMUP_THREADS,
+						    opts -> warmup_rate,
+						    max_cache_size);
+			if (sv -> warmup == NULL){
+				fprintf(stderr, "could not read manifest %s\n",
+					opts -> warmup_file);
+				exit(1);
 			}
 		}
+		/* each stage queues up to max_requests connections */
+		for (int i = 0; opts -> stage_threads[0] > 0 && i < NR_STAGES; i++){
+			sv -> stages[i] = stage_init(stage_names[i],
+						     opts -> stage_threads[i],
+						     max_requests,
+						     stage_handlers[i], sv);
+		}
 	}
 	return sv;
 }
 
-void
-server_request(struct server *sv, int connfd)
+/* the number of connections queued for or run by a worker */
+static int
+worker_load(struct worker *w)
+{
+	return queue_depth(w->queue) +
+		atomic_load_explicit(&w->busy, memory_order_relaxed);
+}
+
+/* picks the worker that a ready connection is queued for */
+static struct worker *
+server_pick_worker(struct server *sv, struct conn *conn)
+{
+	struct worker *best = NULL;
+	int i, load, best_load = INT_MAX;
+
+	/* the worker that ran the connection last has its data cached */
+	if (conn->worker && atomic_load_explicit(&conn->worker->state,
+						 memory_order_relaxed) ==
+	    WORKER_RUNNING && worker_load(conn->worker) == 0) {
+		return conn->worker;
+	}
+	/* the least loaded worker. the search starts after the worker picked
+	 * last, so that the workers take turns when they are all idle. */
+	for (i = 0; i < sv->nr_threads && best_load > 0; i++) {
+		struct worker *w = &sv->workers[(sv->next_worker + i) %
+						sv->nr_threads];
+
+		if (atomic_load_explicit(&w->state, memory_order_relaxed) !=
+		    WORKER_RUNNING) {
+			continue;
+		}
+		load = worker_load(w);
+		if (load < best_load) {
+			best = w;
+			best_load = load;
+		}
+	}
+	sv->next_worker = (best - sv->workers + 1) % sv->nr_threads;
+	return best;
+}
+
+/* starts a worker in the first free slot, if there is one */
+static void
+server_grow(struct server *sv)
+{
+	int i, state;
+
+	for (i = 0; i < sv->nr_threads; i++) {
+		state = atomic_load(&sv->workers[i].state);
+		if (state == WORKER_RETIRED) {
+			/* its thread has exited, or is about to */
+			assert(!pthread_join(sv->worker_thread_list[i], NULL));
+			state = WORKER_STOPPED;
+		}
+		if (state == WORKER_STOPPED) {
+			worker_start(sv, i);
+			return;
+		}
+	}
+}
+
+/* grows an elastic pool that can't keep up, once a tick at most */
+static void
+server_tick(struct server *sv, long now)
+{
+	long waits[NR_WAIT_BUCKETS], nr_waits = 0, n = 0;
+	int i, b, depth = 0, grow = 0;
+
+	if (now < sv->next_tick) {
+		return;
+	}
+	sv->next_tick = now + POOL_TICK_US;
+
+	/* the connections queued per running worker */
+	for (i = 0; i < sv->nr_threads; i++) {
+		if (atomic_load(&sv->workers[i].state) == WORKER_RUNNING) {
+			depth += queue_depth(sv->workers[i].queue);
+		}
+	}
+	if (depth >= POOL_HIGH_WATER * atomic_load(&sv->nr_running)) {
+		grow = ++sv->nr_high_ticks >= 2;
+	} else {
+		sv->nr_high_ticks = 0;
+	}
+
+	/* the 99th percentile of the waits since the last tick */
+	for (b = 0; b < NR_WAIT_BUCKETS; b++) {
+		waits[b] = -sv->waits[b];
+		for (i = 0; i < sv->nr_threads; i++) {
+			waits[b] += atomic_load_explicit(
+				&sv->workers[i].waits[b], memory_order_relaxed);
+		}
+		nr_waits += waits[b];
+	}
+	if (nr_waits >= POOL_MIN_WAITS) {
+		for (b = 0; (n += waits[b]) * 100 < nr_waits * 99; b++)
+			;
+		/* bucket b holds the waits from 2^b microseconds */
+		if ((1L << b) >= POOL_MAX_WAIT_US) {
+			grow = 1;
+		}
+		for (b = 0; b < NR_WAIT_BUCKETS; b++) {
+			sv->waits[b] += waits[b];
+		}
+	}
+
+	if (grow) {
+		sv->nr_high_ticks = 0;
+		server_grow(sv);
+	}
+}
+
+/* hands a connection whose socket is ready to a worker. returns NULL, or the
+ * connection that is left if the queues are full, which may be another one
+ * that was taken back from a retiring worker. */
+static struct conn *
+server_request(struct server *sv, struct conn *conn)
 {
-	if (sv->nr_threads == 0) { /* no worker threads */
-		do_server_request(sv, connfd);
+	if (sv->stages[0]) {
+		if (!stage_try_push(sv->stages[conn->writing ? STAGE_SEND :
+					       STAGE_PARSE], conn)) {
+			return conn;
+		}
+	} else if (sv->nr_threads == 0) { /* no worker threads */
+		conn_run(sv, conn);
 	} else {
 		/*  Save the relevant info in a buffer and have one of the
-		 *  worker threads do the work. */
-		//also use the notation of the code in F2-monitors slide 7 of producer-consumer with monitors
-		pthread_mutex_lock(&buffer_lock);
-		while ((in - out + sv -> max_requests + 1) % (sv -> max_requests + 1) == sv -> max_requests){
-			pthread_cond_wait(&cv_full, &buffer_lock);
-		} //full
+		 *  worker threads do the work. this wakes up the worker if
+		 *  it is idle. */
+		struct worker *w;
+		int depth;
+
+		if (sv -> min_threads < sv -> nr_threads){
+			conn -> queued = server_time_us();
+			server_tick(sv, conn -> queued);
+		}
+		do {
+			/* the least loaded worker has a full queue only if
+			 * they all have */
+			w = server_pick_worker(sv, conn);
+			if (!queue_try_push(w -> queue, conn)){
+				return conn;
+			}
+			depth = queue_depth(w -> queue);
+			if (depth > w -> max_depth){
+				w -> max_depth = depth;
+			}
+			/* pairs with the fence in worker_retire. if the
+			 * worker retired, take the connection back, unless it
+			 * has been served already. */
+			atomic_thread_fence(memory_order_seq_cst);
+		} while (atomic_load(&w -> state) != WORKER_RUNNING &&
+			 (conn = queue_try_pop(w -> queue)) != NULL);
+	}
+	return NULL;
+}
+
+static void
+reactor_init(struct reactor *rx, struct server *sv, int listenfd, int stopfd)
+{
+	struct epoll_event ev;
+	int flags;
+
+	rx->sv = sv;
+	rx->listenfd = listenfd;
+	rx->stopfd = stopfd;
+	rx->cpu = -1;
+	pthread_mutex_init(&rx->conns_lock, NULL);
+	rx->conns.prev = rx->conns.next = &rx->conns;
+	rx->next_sweep = 0;
+	rx->nr_expired = 0;
+	rx->backlog = NULL;
+	rx->backlog_tail = &rx->backlog;
+	rx->nr_deferred = 0;
+	rx->accept_retry = 0;
+	SYS(rx->epfd = epoll_create1(EPOLL_CLOEXEC));
+
+	SYS(flags = fcntl(listenfd, F_GETFL, 0));
+	SYS(fcntl(listenfd, F_SETFL, flags | O_NONBLOCK));
+	/* the listener and stopfd are told apart by their data.ptr, which
+	 * doesn't point to a connection */
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &rx->listenfd;
+	SYS(epoll_ctl(rx->epfd, EPOLL_CTL_ADD, listenfd, &ev));
+	/* level-triggered, so that every reactor sees a shared stopfd */
+	ev.events = EPOLLIN;
+	ev.data.ptr = &rx->stopfd;
+	SYS(epoll_ctl(rx->epfd, EPOLL_CTL_ADD, stopfd, &ev));
+}
+
+/* closes the connections that were idle or waiting for their socket, once no
+ * thread is left to run them */
+static void
+reactor_destroy(struct reactor *rx)
+{
+	while (rx->conns.next != &rx->conns) {
+		conn_close(rx->conns.next);
+	}
+	SYS(close(rx->epfd));
+	SYS(close(rx->listenfd));
+	pthread_mutex_destroy(&rx->conns_lock);
+}
+
+/* accepts all the pending connections, there is no further event for them
+ * with an edge-triggered listener */
+static void
+reactor_accept(struct reactor *rx)
+{
+	struct epoll_event ev;
+	struct conn *conn;
+	int connfd;
+
+	while (1) {
+		/* connfd is the socket descriptor the server will use to send
+		 * data to the client */
+		connfd = accept4(rx->listenfd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (connfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				rx->accept_retry = 0;
+				return;
+			}
+			/* out of descriptors or memory, e.g., EMFILE. try
+			 * again once some connections may have closed. */
+			if (rx->accept_retry == 0) {
+				perror("accept4");
+			}
+			rx->accept_retry = server_time_us() + ACCEPT_RETRY_US;
+			return;
+		}
+		conn = pool_alloc(rx->sv->conn_pool);
+		conn->fd = connfd;
+		conn->data = file_data_init();
+		conn->rq = request_init(connfd, conn->data);
+		conn->writing = 0;
+		conn->rx = rx;
+		conn->worker = NULL;
+		conn->deferred = NULL;
+		atomic_init(&conn->armed, server_time_us());
+		pthread_mutex_lock(&rx->conns_lock);
+		conn->next = rx->conns.next;
+		conn->prev = &rx->conns;
+		conn->next->prev = conn;
+		rx->conns.next = conn;
+		pthread_mutex_unlock(&rx->conns_lock);
+		/* the request has usually arrived already, and then epoll
+		 * reports it right away */
+		ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		SYS(epoll_ctl(rx->epfd, EPOLL_CTL_ADD, connfd, &ev));
+	}
+}
+
+/* shuts down the connections that have been waiting for their client for
+ * longer than conn_timeout. the ones that are running aren't armed. */
+static void
+reactor_sweep(struct reactor *rx)
+{
+	struct conn *conn;
+	long now = server_time_us(), armed;
+
+	if (now < rx->next_sweep) {
+		return;
+	}
+	rx->next_sweep = now + rx->sv->conn_timeout * 500L;
+	pthread_mutex_lock(&rx->conns_lock);
+	for (conn = rx->conns.next; conn != &rx->conns; conn = conn->next) {
+		armed = atomic_load(&conn->armed);
+		if (armed == 0 || now - armed < rx->sv->conn_timeout * 1000L) {
+			continue;
+		}
+		/* the socket is closed by the thread that runs the
+		 * connection next, it stays open while the lock is held */
+		shutdown(conn->fd, SHUT_RDWR);
+		atomic_store(&conn->armed, 0);
+		rx->nr_expired++;
+	}
+	pthread_mutex_unlock(&rx->conns_lock);
+}
+
+/* adds a connection to the tail of the backlog */
+static void
+reactor_defer(struct reactor *rx, struct conn *conn)
+{
+	conn->deferred = NULL;
+	*rx->backlog_tail = conn;
+	rx->backlog_tail = &conn->deferred;
+	rx->nr_deferred++;
+}
+
+/* hands over the backlog, in order, until the queues are full again */
+static void
+reactor_retry(struct reactor *rx)
+{
+	struct conn *conn;
+
+	while ((conn = rx->backlog) != NULL) {
+		if ((rx->backlog = conn->deferred) == NULL) {
+			rx->backlog_tail = &rx->backlog;
+		}
+		if ((conn = server_request(rx->sv, conn)) != NULL) {
+			/* back to the head */
+			if ((conn->deferred = rx->backlog) == NULL) {
+				rx->backlog_tail = &conn->deferred;
+			}
+			rx->backlog = conn;
+			return;
+		}
+	}
+}
+
+/* how long epoll may wait, in milliseconds, or -1 */
+static int
+reactor_timeout(struct reactor *rx)
+{
+	int timeout = -1, conn_timeout = rx->sv->conn_timeout;
+	long retry;
+
+	if (rx->backlog) {
+		return BACKLOG_RETRY_MS;
+	}
+	if (rx->accept_retry) {
+		retry = rx->accept_retry - server_time_us();
+		timeout = retry > 0 ? (retry + 999) / 1000 : 0;
+	}
+	/* wake up to look for idle connections */
+	if (conn_timeout > 0 && (timeout < 0 || conn_timeout / 2 < timeout)) {
+		timeout = conn_timeout / 2 > 0 ? conn_timeout / 2 : 1;
+	}
+	return timeout;
+}
+
+/* runs the reactor until its stopfd becomes readable. the connections that
+ * are ready are served right away with reuseport, and handed to the workers
+ * otherwise. */
+static void
+reactor_run(struct reactor *rx)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct server *sv = rx->sv;
+	int i, n;
+	struct conn *conn;
+
+	while (1) {
+		/* wait for clients to connect, connections to be ready, or an
+		 * exit event */
+		n = epoll_wait(rx->epfd, events, MAX_EVENTS,
+			       reactor_timeout(rx));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			unix_error("epoll_wait");
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &rx->stopfd) {
+				/* exit requested */
+				return;
+			}
+			if (events[i].data.ptr == &rx->listenfd) {
+				/* connect requests arrived */
+				reactor_accept(rx);
+				continue;
+			}
+			/* serve the request */
+			conn = events[i].data.ptr;
+			atomic_store(&conn->armed, 0);
+			if (sv->reuseport) {
+				conn_run(sv, conn);
+			} else if (rx->backlog ||
+				   (conn = server_request(sv, conn)) != NULL) {
+				/* after the ones that got ready earlier */
+				reactor_defer(rx, conn);
+			}
+		}
+		if (rx->backlog) {
+			reactor_retry(rx);
+		}
+		if (rx->accept_retry && server_time_us() >= rx->accept_retry) {
+			reactor_accept(rx);
+		}
+		/* after the events, so that the connections that just got
+		 * ready are running */
+		if (sv->conn_timeout > 0) {
+			reactor_sweep(rx);
+		}
+	}
+}
+
+/* a worker with its own listener, with reuseport */
+static void *
+acceptor_function(void *arg)
+{
+	struct reactor *rx = arg;
+	cpu_set_t cpus;
+
+	/* the connections accepted on this CPU are served on it */
+	CPU_ZERO(&cpus);
+	CPU_SET(rx->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	reactor_run(rx);
+	return NULL;
+}
+
+/* the CPUs that workers are pinned to, in the order they are used */
+static int
+server_cpus(int *cpus, int max)
+{
+	cpu_set_t allowed;
+	int cpu, n = 0;
 
-		buffer[in] = connfd;
-		in = (in + 1) % (sv -> max_requests + 1);
-		pthread_cond_broadcast(&cv_empty);
-		pthread_mutex_unlock(&buffer_lock);
+	SYS(sched_getaffinity(0, sizeof(allowed), &allowed));
+	for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+		if (CPU_ISSET(cpu, &allowed)) {
+			cpus[n++] = cpu;
+		}
+	}
+	return n;
+}
+
+void
+server_loop(struct server *sv, int port, int exitfd)
+{
+	struct pollfd pfd = { exitfd, POLLIN };
+	int *cpus, nr_cpus, i;
+
+	if (!sv->reuseport) {
+		sv->nr_reactors = 1;
+		sv->reactors = Malloc(sizeof(struct reactor));
+		reactor_init(sv->reactors, sv, open_listenfd(port, 0), exitfd);
+		reactor_run(sv->reactors);
+		return;
+	}
+
+	/* all the listeners are open before any connection is accepted, the
+	 * kernel only spreads connections over the listeners that exist */
+	sv->nr_reactors = sv->nr_threads;
+	sv->reactors = Malloc(sizeof(struct reactor) * sv->nr_threads);
+	SYS(sv->stopfd = eventfd(0, EFD_CLOEXEC));
+	cpus = Malloc(sizeof(int) * CPU_SETSIZE);
+	nr_cpus = server_cpus(cpus, CPU_SETSIZE);
+	for (i = 0; i < sv->nr_threads; i++) {
+		reactor_init(&sv->reactors[i], sv, open_listenfd(port, 1),
+			     sv->stopfd);
+		sv->reactors[i].cpu = cpus[i % nr_cpus];
+	}
+	free(cpus);
+	for (i = 0; i < sv->nr_threads; i++) {
+		pthread_create(&sv->worker_thread_list[i], NULL,
+			       acceptor_function, &sv->reactors[i]);
+	}
+	/* the workers do all the work, wait for an exit event */
+	while (poll(&pfd, 1, -1) < 0) {
+		if (errno != EINTR)
+			unix_error("poll");
+	}
+}
+
+/* prints how the connections were spread over the workers on stdout */
+static void
+server_print_stats(struct server *sv)
+{
+	long nr_runs = 0, nr_stolen = 0;
+	int i;
+
+	for (i = 0; i < sv->nr_threads; i++) {
+		struct worker *w = &sv->workers[i];
+
+		printf("worker %d: runs = %ld, stolen = %ld, "
+		       "max queue depth = %d\n", i, w->nr_runs, w->nr_stolen,
+		       w->max_depth);
+		nr_runs += w->nr_runs;
+		nr_stolen += w->nr_stolen;
+	}
+	printf("workers: runs = %ld, stolen = %ld\n", nr_runs, nr_stolen);
+	if (sv->min_threads < sv->nr_threads) {
+		printf("pool: min = %d, max = %d, started = %d, retired = %d, "
+		       "most running = %d\n", sv->min_threads, sv->nr_threads,
+		       sv->nr_started, atomic_load(&sv->nr_retired),
+		       sv->max_running);
 	}
 }
 
@@ -380,15 +1263,96 @@ server_exit(struct server *sv)
 	 * these threads that the server is exiting. make sure to call
 	 * pthread_join in this function so that the main server thread waits
 	 * for all the worker threads to exit before exiting. */
-	sv->exiting = 1;
 	//added for Lab4
-	pthread_cond_broadcast(&cv_full);
-	pthread_cond_broadcast(&cv_empty);
+	sv->exiting = 1;
+	/* the workers serve the connections left in their queues, then
+	 * exit */
+	for (int i = 0; sv -> workers && i < sv -> nr_threads; i++){
+		queue_close(sv -> workers[i].queue);
+	}
+	if (sv -> reuseport){
+		uint64_t one = 1;
+		/* stops the reactors of all the workers */
+		SYS(write(sv -> stopfd, &one, sizeof(one)));
+	}
 	for (int i = 0; i < sv -> nr_threads; i++){
+		/* the workers of an elastic pool that never ran */
+		if (sv -> workers && atomic_load(&sv -> workers[i].state) ==
+		    WORKER_STOPPED){
+			continue;
+		}
 		assert(!pthread_join(sv -> worker_thread_list[i], NULL));
 	}
+	/* each stage finishes the connections that the stages before it
+	 * handed on. the loader hands on the files that the fetch stage
+	 * asked for. */
+	for (int i = 0; sv -> stages[0] && i < NR_STAGES; i++){
+		if (i == STAGE_FETCH){
+			pthread_mutex_lock(&sv -> fetched_lock);
+			sv -> fetched_closed = 1;
+			pthread_mutex_unlock(&sv -> fetched_lock);
+		}
+		stage_stop(sv -> stages[i]);
+		if (i == STAGE_FETCH){
+			request_loader_stop();
+			stage_fetched_all(sv);
+		}
+	}
+	request_loader_stop();
 	/* make sure to free any allocated resources */
 	free(sv -> worker_thread_list);
-	free(buffer);
+	for (int i = 0; sv -> stages[0] && i < NR_STAGES; i++){
+		stage_print_stats(sv -> stages[i]);
+		stage_destroy(sv -> stages[i]);
+	}
+	pthread_mutex_destroy(&sv -> fetched_lock);
+	if (sv -> workers){
+		server_print_stats(sv);
+		for (int i = 0; i < sv -> nr_threads; i++){
+			queue_destroy(sv -> workers[i].queue);
+		}
+		free(sv -> workers);
+	}
+	long nr_expired = 0, nr_deferred = 0;
+	for (int i = 0; i < sv -> nr_reactors; i++){
+		nr_expired += sv -> reactors[i].nr_expired;
+		nr_deferred += sv -> reactors[i].nr_deferred;
+		reactor_destroy(&sv -> reactors[i]);
+	}
+	if (sv -> conn_timeout > 0){
+		printf("connections: %ld shut down when idle\n", nr_expired);
+	}
+	if (!sv -> reuseport){
+		printf("connections: %ld deferred while the queues were "
+		       "full\n", nr_deferred);
+	}
+	free(sv -> reactors);
+	if (sv -> reuseport){
+		SYS(close(sv -> stopfd));
+	}
+	if (sv -> warmup){
+		warmup_stop(sv -> warmup);
+	}
+	if (sv -> cache && sv -> snapshot_file){
+		int nr_files = snapshot_write(sv -> cache, sv -> snapshot_file);
+
+		if (nr_files < 0){
+			fprintf(stderr, "could not write snapshot %s\n",
+				sv -> snapshot_file);
+		}else{
+			printf("snapshot: %d files written to %s\n", nr_files,
+			       sv -> snapshot_file);
+		}
+	}
+	if (sv -> cache){
+		cache_print_stats(sv -> cache);
+		cache_destroy(sv -> cache);
+	}
+	if (sv -> index){
+		file_index_destroy(sv -> index);
+	}
+	/* the connections left were closed with the reactors */
+	pool_print_stats(sv -> conn_pool);
+	pool_destroy(sv -> conn_pool);
 	free(sv);
 }
@@ -3,9 +3,62 @@
 
 struct server;
 
+/* the stages of the staged pipeline */
+enum {
+	STAGE_PARSE,		/* reads the request */
+	STAGE_FETCH,		/* looks up the file in the cache, or reads it */
+	STAGE_PROCESS,		/* processes the file */
+	STAGE_SEND,		/* writes the response */
+	NR_STAGES,
+};
+
+/* how files are read, see loader.h */
+enum {
+	LOADER_NONE,		/* on the thread that handles the request */
+	LOADER_URING,		/* by io_uring, or threads if there is none */
+	LOADER_THREADS,		/* by a pool of threads */
+};
+
+/* optional settings, set from the command line options in server.c */
+struct server_options {
+	char *cache_policy;	/* replacement policy, see cache.h */
+	int cache_max_file_size;	/* largest file cached, 0 for no limit */
+	double cache_size_weight;	/* gdsf size weight, see cache.h */
+	int cache_mmap;		/* cache mmaps of the files, not heap copies */
+	/* checksums of the files, so that files that are not cached can be
+	 * sent without reading them. NULL if there is no index. */
+	char *index_file;
+	/* each worker accepts and serves connections on a SO_REUSEPORT
+	 * listener of its own, pinned to a CPU */
+	int reuseport;
+	/* the pool of workers shrinks down to min_threads workers when they
+	 * are idle for idle_timeout milliseconds, and grows back up to
+	 * nr_threads under load. 0 for a fixed pool of nr_threads workers. */
+	int min_threads;
+	int idle_timeout;
+	/* connections whose client sends and reads nothing for this many
+	 * milliseconds are closed, 0 to keep them open */
+	int conn_timeout;
+	/* the threads of each stage of a staged pipeline, which replaces the
+	 * worker threads. all 0 without it. */
+	int stage_threads[NR_STAGES];
+	/* reads the files asynchronously. the fetch stage of the staged
+	 * pipeline goes on with other connections meanwhile. */
+	int loader;
+	/* a manifest of the files to load into the cache at startup, hottest
+	 * first, see warmup.h. NULL for none. warmup_rate caps the bandwidth
+	 * of the loads in KB/s, 0 for no cap. */
+	char *warmup_file;
+	int warmup_rate;
+	/* a snapshot of the cache, written at exit and used to warm up the
+	 * cache at startup if there is no warmup_file. NULL for none. */
+	char *snapshot_file;
+};
+
 struct server *server_init(int nr_threads, int max_requests, 
-			   int max_cache_size);
-void server_request(struct server *sv, int connfd);
+			   int max_cache_size, struct server_options *opts);
+/* serves the connections to port until exitfd becomes readable */
+void server_loop(struct server *sv, int port, int exitfd);
 void server_exit(struct server *sv);
 
 #endif /* __SERVER_THREAD_H__ */
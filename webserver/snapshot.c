@@ -0,0 +1,159 @@
+/*
+ * snapshot.c: Snapshots of the cache, so that a restarted server can refill
+ * it quickly.
+ *
+ * The server writes a snapshot when it exits, and warms up its cache from the
+ * snapshot when it starts again, see warmup.c. A snapshot lists the cached
+ * files, hottest first, with the size, modification time and checksum that
+ * each file had when it was read, so that a file that changed since is not
+ * restored.
+ *
+ * A snapshot is a binary file: a header, then a record per file, each followed
+ * by the file's name. Numbers are in the host's byte order, since a snapshot
+ * is read back by the server that wrote it. It is written to a temporary file
+ * that is renamed over the old snapshot, so a server that is killed while
+ * writing it leaves the old snapshot in place.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC 0x50414e53	/* "SNAP" */
+#define SNAPSHOT_VERSION 1
+/* a header that says more is corrupt */
+#define SNAPSHOT_MAX_FILES (1 << 24)
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_files;
+	uint32_t unused;
+};
+
+/* laid out without padding */
+struct snapshot_record {
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	int32_t size;
+	uint32_t csum;
+	uint32_t name_len;
+};
+
+struct snapshot_writer {
+	FILE *f;
+	int nr_files;
+	int error;
+};
+
+static void
+snapshot_write_file(void *arg, struct file_data *data)
+{
+	struct snapshot_writer *sw = arg;
+	struct snapshot_record rec;
+
+	rec.mtime_sec = data->file_mtime.tv_sec;
+	rec.mtime_nsec = data->file_mtime.tv_nsec;
+	rec.size = data->file_size;
+	rec.csum = data->file_csum;
+	rec.name_len = strlen(data->file_name);
+	if (fwrite(&rec, sizeof(rec), 1, sw->f) != 1 ||
+	    fwrite(data->file_name, rec.name_len, 1, sw->f) != 1) {
+		sw->error = 1;
+	}
+	sw->nr_files++;
+}
+
+int
+snapshot_write(struct cache *c, char *path)
+{
+	struct snapshot_header hdr = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, 0 };
+	struct snapshot_writer sw;
+	char tmp[MAXLINE];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((sw.f = fopen(tmp, "w")) == NULL) {
+		return -1;
+	}
+	sw.nr_files = 0;
+	sw.error = fwrite(&hdr, sizeof(hdr), 1, sw.f) != 1;
+	cache_walk(c, snapshot_write_file, &sw);
+	/* the number of files is known once they are written */
+	hdr.nr_files = sw.nr_files;
+	if (fseek(sw.f, 0, SEEK_SET) < 0 ||
+	    fwrite(&hdr, sizeof(hdr), 1, sw.f) != 1) {
+		sw.error = 1;
+	}
+	if (fclose(sw.f) != 0 || sw.error || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return sw.nr_files;
+}
+
+struct snapshot_file *
+snapshot_read(char *path, int *nr_files)
+{
+	struct snapshot_header hdr;
+	struct snapshot_record rec;
+	struct snapshot_file *files;
+	FILE *f;
+	int i;
+
+	*nr_files = 0;
+	if ((f = fopen(path, "r")) == NULL) {
+		return NULL;
+	}
+	/* a file without the magic is something else, e.g., a manifest */
+	if (fread(&hdr.magic, sizeof(hdr.magic), 1, f) != 1 ||
+	    hdr.magic != SNAPSHOT_MAGIC) {
+		fclose(f);
+		return NULL;
+	}
+	*nr_files = -1;
+	if (fread(&hdr.version, sizeof(hdr) - sizeof(hdr.magic), 1, f) != 1 ||
+	    hdr.version != SNAPSHOT_VERSION ||
+	    hdr.nr_files > SNAPSHOT_MAX_FILES) {
+		fclose(f);
+		return NULL;
+	}
+	files = Malloc(sizeof(struct snapshot_file) * (hdr.nr_files + 1));
+	for (i = 0; i < hdr.nr_files; i++) {
+		struct snapshot_file *sf = &files[i];
+
+		if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+		    rec.name_len >= MAXLINE) {
+			break;
+		}
+		sf->name = Malloc(rec.name_len + 1);
+		if (fread(sf->name, rec.name_len, 1, f) != 1) {
+			free(sf->name);
+			break;
+		}
+		sf->name[rec.name_len] = 0;
+		sf->size = rec.size;
+		sf->csum = rec.csum;
+		sf->mtime.tv_sec = rec.mtime_sec;
+		sf->mtime.tv_nsec = rec.mtime_nsec;
+	}
+	fclose(f);
+	if (i < hdr.nr_files) {
+		/* truncated, or a record is corrupt */
+		snapshot_free(files, i);
+		return NULL;
+	}
+	*nr_files = i;
+	return files;
+}
+
+void
+snapshot_free(struct snapshot_file *files, int nr_files)
+{
+	int i;
+
+	for (i = 0; i < nr_files; i++) {
+		free(files[i].name);
+	}
+	free(files);
+}
@@ -0,0 +1,24 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+struct cache;
+
+/* a file recorded by a snapshot of the cache, as it was when it was read */
+struct snapshot_file {
+	char *name;		/* as formed by the server */
+	int size;
+	unsigned int csum;
+	struct timespec mtime;
+};
+
+/* writes a snapshot of the files in c to path, the ones that the policy would
+ * evict last first. returns the number of files, or -1 if it can't be
+ * written. */
+int snapshot_write(struct cache *c, char *path);
+/* returns the files of the snapshot at path, and their number in nr_files.
+ * returns NULL if path is not a snapshot, with nr_files 0, or if it is a
+ * corrupt one, e.g., truncated or of another version, with nr_files -1. */
+struct snapshot_file *snapshot_read(char *path, int *nr_files);
+void snapshot_free(struct snapshot_file *files, int nr_files);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,163 @@
+/*
+ * stage.c: Stages of a staged event-driven pipeline (SEDA).
+ *
+ * Each stage has a bounded queue and a pool of threads of its own, so a
+ * stage that blocks, such as one that reads from the disk, doesn't hold up
+ * the work of the other stages, and each stage can be sized on its own. The
+ * queues are the lock-free queues of queue.c.
+ *
+ * A stage keeps the statistics that it is sized by: the length of its queue,
+ * seen by every push, and the time that its threads take to handle an item.
+ */
+
+#include "common.h"
+#include "queue.h"
+#include "stage.h"
+
+struct stage {
+	char *name;
+	struct queue *queue;
+	int nr_threads;
+	pthread_t *threads;
+	void (*handle)(void *arg, void *item);
+	void *arg;
+	/* statistics, updated by the threads that push to the stage and by
+	 * the stage's threads */
+	atomic_long nr_pushed;
+	atomic_long depth_sum;	/* queue lengths seen by the pushes */
+	atomic_int max_depth;
+	atomic_long nr_handled;
+	atomic_long service_sum;	/* in microseconds */
+	atomic_long max_service;
+};
+
+/* monotonic time in microseconds */
+static long
+stage_time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+static void *
+stage_thread(void *arg)
+{
+	struct stage *st = arg;
+	long start, service, max;
+	void *item;
+
+	while ((item = queue_pop(st->queue)) != NULL) {
+		start = stage_time_us();
+		st->handle(st->arg, item);
+		service = stage_time_us() - start;
+		atomic_fetch_add_explicit(&st->nr_handled, 1,
+					  memory_order_relaxed);
+		atomic_fetch_add_explicit(&st->service_sum, service,
+					  memory_order_relaxed);
+		max = atomic_load_explicit(&st->max_service,
+					   memory_order_relaxed);
+		while (service > max &&
+		       !atomic_compare_exchange_weak_explicit(
+			       &st->max_service, &max, service,
+			       memory_order_relaxed, memory_order_relaxed))
+			;
+	}
+	return NULL;
+}
+
+struct stage *
+stage_init(char *name, int nr_threads, int queue_size,
+	   void (*handle)(void *arg, void *item), void *arg)
+{
+	struct stage *st = Malloc(sizeof(struct stage));
+	int i;
+
+	assert(nr_threads > 0);
+	st->name = name;
+	st->queue = queue_init(queue_size);
+	st->nr_threads = nr_threads;
+	st->threads = Malloc(sizeof(pthread_t) * nr_threads);
+	st->handle = handle;
+	st->arg = arg;
+	atomic_init(&st->nr_pushed, 0);
+	atomic_init(&st->depth_sum, 0);
+	atomic_init(&st->max_depth, 0);
+	atomic_init(&st->nr_handled, 0);
+	atomic_init(&st->service_sum, 0);
+	atomic_init(&st->max_service, 0);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_create(&st->threads[i], NULL, stage_thread, st);
+	}
+	return st;
+}
+
+/* counts an item that was pushed to the stage */
+static void
+stage_pushed(struct stage *st)
+{
+	int depth = queue_depth(st->queue), max;
+
+	atomic_fetch_add_explicit(&st->nr_pushed, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&st->depth_sum, depth, memory_order_relaxed);
+	max = atomic_load_explicit(&st->max_depth, memory_order_relaxed);
+	while (depth > max &&
+	       !atomic_compare_exchange_weak_explicit(&st->max_depth, &max,
+						      depth,
+						      memory_order_relaxed,
+						      memory_order_relaxed))
+		;
+}
+
+void
+stage_push(struct stage *st, void *item)
+{
+	queue_push(st->queue, item);
+	stage_pushed(st);
+}
+
+int
+stage_try_push(struct stage *st, void *item)
+{
+	if (!queue_try_push(st->queue, item)) {
+		return 0;
+	}
+	stage_pushed(st);
+	return 1;
+}
+
+void
+stage_stop(struct stage *st)
+{
+	int i;
+
+	queue_close(st->queue);
+	for (i = 0; i < st->nr_threads; i++) {
+		assert(!pthread_join(st->threads[i], NULL));
+	}
+}
+
+void
+stage_print_stats(struct stage *st)
+{
+	long nr_pushed = atomic_load(&st->nr_pushed);
+	long nr_handled = atomic_load(&st->nr_handled);
+
+	printf("stage %s: threads = %d, handled = %ld, "
+	       "mean service = %.1f us, max service = %ld us, "
+	       "mean queue = %.2f, max queue = %d\n", st->name,
+	       st->nr_threads, nr_handled,
+	       nr_handled ? (double)atomic_load(&st->service_sum) /
+	       nr_handled : 0, atomic_load(&st->max_service),
+	       nr_pushed ? (double)atomic_load(&st->depth_sum) / nr_pushed : 0,
+	       atomic_load(&st->max_depth));
+}
+
+void
+stage_destroy(struct stage *st)
+{
+	queue_destroy(st->queue);
+	free(st->threads);
+	free(st);
+}
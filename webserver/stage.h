@@ -0,0 +1,21 @@
+#ifndef __STAGE_H__
+#define __STAGE_H__
+
+/* a stage of a staged event-driven pipeline. a pool of threads takes the
+ * items pushed to the stage's bounded queue, and runs handle on each. */
+struct stage;
+
+struct stage *stage_init(char *name, int nr_threads, int queue_size,
+			 void (*handle)(void *arg, void *item), void *arg);
+/* queues item, which must not be NULL, waiting while the queue is full */
+void stage_push(struct stage *st, void *item);
+/* like stage_push, but returns 0 at once if the queue is full */
+int stage_try_push(struct stage *st, void *item);
+/* waits for the items queued already to be handled, and for the threads to
+ * exit. nothing may be pushed to the stage after this. */
+void stage_stop(struct stage *st);
+/* prints the queue lengths and service times on stdout */
+void stage_print_stats(struct stage *st);
+void stage_destroy(struct stage *st);
+
+#endif /* __STAGE_H__ */
@@ -0,0 +1,272 @@
+/*
+ * warmup.c: Warms up the cache when the server starts.
+ *
+ * A few threads load the files listed in a manifest into the cache while the
+ * server is already serving requests, so that the first requests for those
+ * files are hits. The manifest lists the hottest files first, and loading
+ * stops once the files loaded would fill the cache. Each load reserves its
+ * size out of the budget before it reads the file, so that the threads
+ * together never load more than the cache holds.
+ *
+ * The manifest may also be a snapshot of the cache of an earlier run, see
+ * snapshot.c. Its files are only restored if they haven't changed since, and
+ * with mapped files, they are mapped without being read.
+ *
+ * The loads are paced so that they take at most a given bandwidth from the
+ * disk. Each load reserves the next slot of time that its size allows, and
+ * waits for it. A file that a request is already loading is skipped, and a
+ * request that misses on a file that is being warmed up waits for that load
+ * as it would for any other, see cache_preload_start.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "snapshot.h"
+#include "warmup.h"
+
+struct warmup {
+	struct cache *cache;
+	int map;
+	/* the size of a file is -1 if it is not known, when the manifest is
+	 * not a snapshot */
+	struct snapshot_file *files;
+	int nr_files;
+	long budget;		/* in bytes */
+	atomic_long reserved;	/* of the budget, by the loads so far */
+	int rate;		/* in KB/s, 0 for no cap */
+	int nr_threads;
+	pthread_t *threads;
+	atomic_int next;	/* the next file to load */
+	/* the pacing of the loads */
+	pthread_mutex_t lock;
+	pthread_cond_t stop;	/* signaled when stopping is set */
+	int stopping;
+	long next_slot;		/* when the next load may start, in us */
+	/* statistics */
+	atomic_int nr_loaded;
+	atomic_long nr_bytes;
+	atomic_int nr_running;	/* threads that are still loading */
+	long start;
+	long end;		/* when the last thread was done */
+};
+
+/* monotonic time in microseconds */
+static long
+warmup_time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+/* reads the files in manifest. returns 0 if it can't be read. */
+static int
+warmup_read_manifest(struct warmup *w, char *manifest)
+{
+	char buf[MAXLINE], name[MAXLINE + 2], extra[2];
+	int size = 64, count;
+	FILE *f;
+
+	if ((w->files = snapshot_read(manifest, &w->nr_files)) != NULL) {
+		return 1;
+	}
+	if (w->nr_files < 0) {
+		/* its records can't be trusted, and it is no text manifest
+		 * either, so nothing is warmed up */
+		fprintf(stderr, "warmup: snapshot %s is corrupt, skipping it\n",
+			manifest);
+		w->nr_files = 0;
+		return 1;
+	}
+	if ((f = fopen(manifest, "r")) == NULL) {
+		return 0;
+	}
+	w->files = Malloc(sizeof(struct snapshot_file) * size);
+	w->nr_files = 0;
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		/* an index written by fileset starts with the number of
+		 * files, on a line of its own */
+		if (w->nr_files == 0 &&
+		    sscanf(buf, "%d %1s", &count, extra) == 1) {
+			continue;
+		}
+		/* the server prefixes request URIs with ./ */
+		strcpy(name, "./");
+		if (sscanf(buf, "%s", name + 2) != 1) {
+			continue;
+		}
+		if (w->nr_files == size) {
+			size *= 2;
+			w->files = realloc(w->files,
+					   sizeof(struct snapshot_file) * size);
+			assert(w->files);
+		}
+		w->files[w->nr_files].name = strdup(name);
+		w->files[w->nr_files++].size = -1;
+	}
+	fclose(f);
+	return 1;
+}
+
+/* reserves size bytes of the budget for a load. returns 0 if they would
+ * overflow the cache. */
+static int
+warmup_reserve(struct warmup *w, long size)
+{
+	long reserved = atomic_load(&w->reserved);
+
+	do {
+		if (reserved + size > w->budget) {
+			return 0;
+		}
+	} while (!atomic_compare_exchange_weak(&w->reserved, &reserved,
+					       reserved + size));
+	return 1;
+}
+
+/* waits for the slot of time of a load of size bytes. returns 0 if the
+ * warm-up is stopping. */
+static int
+warmup_pace(struct warmup *w, int size)
+{
+	struct timespec ts;
+	long slot;
+	int stopping;
+
+	pthread_mutex_lock(&w->lock);
+	slot = w->next_slot;
+	if (slot < warmup_time_us()) {
+		slot = warmup_time_us();
+	}
+	w->next_slot = slot + (long)size * 1000000L / (w->rate * 1024L);
+	ts.tv_sec = slot / 1000000;
+	ts.tv_nsec = (slot % 1000000) * 1000;
+	while (!w->stopping && warmup_time_us() < slot) {
+		pthread_cond_timedwait(&w->stop, &w->lock, &ts);
+	}
+	stopping = w->stopping;
+	pthread_mutex_unlock(&w->lock);
+	return !stopping;
+}
+
+static void *
+warmup_thread(void *arg)
+{
+	struct warmup *w = arg;
+	struct snapshot_file *sf;
+	struct file_data *data;
+	struct stat sbuf;
+	int i, size;
+
+	while ((i = atomic_fetch_add(&w->next, 1)) < w->nr_files) {
+		sf = &w->files[i];
+		size = sf->size;
+		if (size < 0) {
+			if (stat(sf->name, &sbuf) < 0) {
+				continue;
+			}
+			size = sbuf.st_size;
+		}
+		if (size > cache_max_file_size(w->cache)) {
+			continue;
+		}
+		if (!warmup_reserve(w, size)) {
+			/* the cache is full */
+			break;
+		}
+		/* restoring a mapped file doesn't read it */
+		if (w->rate > 0 && !(w->map && sf->size >= 0) &&
+		    !warmup_pace(w, size)) {
+			break;
+		}
+		if (!cache_preload_start(w->cache, sf->name)) {
+			/* cached already, or a request is loading it */
+			atomic_fetch_sub(&w->reserved, size);
+			continue;
+		}
+		if (sf->size < 0) {
+			data = request_preloadfile(sf->name, w->map);
+		} else {
+			data = request_restorefile(sf->name, sf->size,
+						   sf->mtime, sf->csum, w->map);
+		}
+		cache_preload_done(w->cache, sf->name, data);
+		/* the file may have changed size since it was stat'ed */
+		atomic_fetch_sub(&w->reserved,
+				 size - (data ? data->file_size : 0));
+		if (data) {
+			atomic_fetch_add(&w->nr_loaded, 1);
+			atomic_fetch_add(&w->nr_bytes, data->file_size);
+			file_data_put(data);
+		}
+	}
+	/* the last thread to be done times the warm-up */
+	if (atomic_fetch_sub(&w->nr_running, 1) == 1) {
+		w->end = warmup_time_us();
+	}
+	return NULL;
+}
+
+struct warmup *
+warmup_start(struct cache *c, char *manifest, int map, int nr_threads,
+	     int rate, long budget)
+{
+	struct warmup *w = Malloc(sizeof(struct warmup));
+	pthread_condattr_t attr;
+	int i;
+
+	if (!warmup_read_manifest(w, manifest)) {
+		free(w);
+		return NULL;
+	}
+	assert(nr_threads > 0);
+	w->cache = c;
+	w->map = map;
+	w->budget = budget;
+	atomic_init(&w->reserved, 0);
+	w->rate = rate;
+	w->nr_threads = nr_threads;
+	w->threads = Malloc(sizeof(pthread_t) * nr_threads);
+	atomic_init(&w->next, 0);
+	pthread_mutex_init(&w->lock, NULL);
+	/* the slots are in monotonic time */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->stop, &attr);
+	pthread_condattr_destroy(&attr);
+	w->stopping = 0;
+	w->next_slot = 0;
+	atomic_init(&w->nr_loaded, 0);
+	atomic_init(&w->nr_bytes, 0);
+	atomic_init(&w->nr_running, nr_threads);
+	w->start = warmup_time_us();
+	w->end = 0;
+	for (i = 0; i < nr_threads; i++) {
+		pthread_create(&w->threads[i], NULL, warmup_thread, w);
+	}
+	return w;
+}
+
+void
+warmup_stop(struct warmup *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stopping = 1;
+	pthread_cond_broadcast(&w->stop);
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < w->nr_threads; i++) {
+		assert(!pthread_join(w->threads[i], NULL));
+	}
+	printf("warmup: loaded %d of %d files, %ld bytes, in %.2f seconds\n",
+	       atomic_load(&w->nr_loaded), w->nr_files,
+	       atomic_load(&w->nr_bytes), (w->end - w->start) / 1e6);
+	snapshot_free(w->files, w->nr_files);
+	pthread_cond_destroy(&w->stop);
+	pthread_mutex_destroy(&w->lock);
+	free(w->threads);
+	free(w);
+}
@@ -0,0 +1,21 @@
+#ifndef __WARMUP_H__
+#define __WARMUP_H__
+
+struct cache;
+
+/* loads the files listed in a manifest into the cache in the background */
+struct warmup;
+
+/* starts nr_threads threads that load the files of manifest into c, in the
+ * order they are listed, until budget bytes have been loaded. the manifest is
+ * an index written by the fileset program, a list of file names, one per
+ * line, or a snapshot of the cache, see snapshot.h. files are mapped if map
+ * is set. rate caps the bandwidth of the loads, in KB/s, 0 for no cap.
+ * returns NULL if the manifest can't be read. */
+struct warmup *warmup_start(struct cache *c, char *manifest, int map,
+			    int nr_threads, int rate, long budget);
+/* stops the loads that haven't started yet, waits for the others, and prints
+ * what was loaded on stdout */
+void warmup_stop(struct warmup *w);
+
+#endif /* __WARMUP_H__ */